@@ -524,277 +524,3398 @@ namespace termcolor
 #undef TERMCOLOR_OS_LINUX
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <ostream>
+#include <queue>
 #include <sstream>
 #include <string>
-#include <unordered_set>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <csignal>
+
+// Sockets, shared memory, durable and sharded files, query_file and watch_config need POSIX
+#if defined(__unix__) || defined(__APPLE__)
+#   define MLOGGER_POSIX
+#   include <dirent.h>
+#   include <fcntl.h>
+#   include <netdb.h>
+#   include <poll.h>
+#   include <sys/mman.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/types.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#elif defined(_WIN32)
+#   include <process.h>
+#endif
+
+#if defined(__linux__)
+#   include <sys/inotify.h>
+#endif
+
 class MLogger {
 
 public:
     typedef std::ostream& (*Colour)(std::ostream &);
 
-    /***** output modifiers *****/
-    static bool add_ostream(std::ostream & stream) {
-        auto streamRefWrapper = std::reference_wrapper<std::ostream>(stream);
-        if (!find_ostream_wrapper_(stream)) {
-            instance_().ostreamWrappers_.push_back(streamRefWrapper);
-            return true;
-        }
-        return false;
+    /***** output modifiers *****/
+    static bool add_ostream(std::ostream & stream) {
+        return update_config_([&](Config & config) {
+            if (find_ostream_wrapper_(config, stream)) {
+                return false;
+            }
+            config.ostreamWrappers.push_back(std::reference_wrapper<std::ostream>(stream));
+            config.ostreamMutexes.push_back(ostream_mutex_(stream));
+            return true;
+        });
+    }
+
+    static void clear_ostreams() {
+        update_config_([](Config & config) {
+            config.ostreamWrappers.clear();
+            config.ostreamMutexes.clear();
+            config.ostreamPtrs.clear();
+            config.fileMutexes.clear();
+            config.fileNames.clear();
+            config.sinks.clear();
+            config.sinkNames.clear();
+            return true;
+        });
+    }
+
+    // With indexed, the file also gets a sidecar index for query_file (see IndexedFileSink)
+    static bool add_file(std::string const & fileName, bool indexed = false) {
+        return update_config_([&](Config & config) {
+            return indexed ? add_indexed_file_(config, fileName) : add_file_(config, fileName);
+        });
+    }
+
+    static void flush() {
+        auto & asyncQueue = instance_().asyncQueue_;
+        if (asyncQueue) {
+            asyncQueue->drain();
+        }
+        ConfigReader config;
+        for (std::size_t i = 0; i < config->ostreamWrappers.size(); ++i) {
+            std::lock_guard<std::mutex> lock(*config->ostreamMutexes[i]);
+            config->ostreamWrappers[i].get().flush();
+        }
+        for (std::size_t i = 0; i < config->ostreamPtrs.size(); ++i) {
+            std::lock_guard<std::mutex> lock(*config->fileMutexes[i]);
+            config->ostreamPtrs[i]->flush();
+        }
+        for (auto & sink : config->sinks) {
+            sink->flush();
+        }
+    }
+
+    /***** sinks *****/
+    // The diagnostic context fields in effect when a record was logged (see MLogger::context).
+    // Immutable once pushed, so it is shared by every record logged under it.
+    struct Context : std::enable_shared_from_this<Context> {
+        std::vector<std::pair<std::string, std::string>> fields; // Outermost first
+        std::string prefix; // Rendered once, e.g. "[req=42 tenant=acme] "
+    };
+
+    struct Record {
+        std::string level;
+        std::string message;
+        int subLevel;
+        std::chrono::system_clock::time_point time;
+        std::string text; // The rendered line, without colour or trailing newline
+        Context const * context; // Null when no context is pushed
+    };
+
+    // The records of a committed MLogger::batch, rendered into one buffer
+    struct Batch {
+        std::vector<Record> records; // Their text is left empty
+        std::string text; // Every record's line, each ending in '\n'
+        std::vector<std::size_t> ends; // Where each record's line ends in text, empty if nothing uses text
+        std::vector<std::shared_ptr<Context const>> contexts; // Keeps the records' contexts alive
+
+        std::string line(std::size_t index) const {
+            if (ends.empty()) {
+                return "";
+            }
+            auto begin = index == 0 ? 0 : ends[index - 1];
+            return text.substr(begin, ends[index] - begin - 1);
+        }
+    };
+
+    struct Span {
+        std::string name;
+        std::string level;
+        int depth;
+        unsigned threadIndex;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::duration duration;
+        Context const * context;
+    };
+
+    struct Sink {
+        virtual ~Sink() {}
+
+        // Receives every record that passes the level check
+        virtual void write(Record const & record) = 0;
+
+        // Receives the records of a committed MLogger::batch. Sinks that can should write
+        // them in one go, so that no other thread's records end up in between; this
+        // default hands them to write() one at a time, which does not guarantee that.
+        virtual void write_batch(Batch const & batch) {
+            for (std::size_t i = 0; i < batch.records.size(); ++i) {
+                auto record = batch.records[i];
+                record.text = batch.line(i);
+                write(record);
+            }
+        }
+
+        // Receives every completed scope whose level is enabled
+        virtual void write_span(Span const &) {}
+
+        // Whether the sink uses Record::text. When no output does, log() skips rendering it.
+        virtual bool wants_text() const {
+            return true;
+        }
+
+        // Whether the sink makes callers logging at level wait, e.g. for stable storage.
+        // Such records skip the async queue, so the wait still holds up the caller.
+        virtual bool waits_for(std::string const &) const {
+            return false;
+        }
+
+        // Pushes out anything the sink is still holding on to
+        virtual void flush() {}
+    };
+
+    static bool add_sink(std::shared_ptr<Sink> const & sink) {
+        return update_config_([&](Config & config) {
+            return add_sink_(config, "", sink);
+        });
+    }
+
+#if defined(MLOGGER_POSIX)
+    enum class SocketType { unix_dgram, unix_stream, udp };
+
+    // Sends records to a local collector over a Unix domain or UDP socket.
+    // Records are packed into datagrams of up to maxDatagram bytes and sent with
+    // non-blocking calls, so a stalled collector costs dropped records (see dropped())
+    // rather than a blocked caller. A background thread flushes partially filled
+    // datagrams every flushInterval and reconnects when the collector goes away.
+    // With syslogFraming, records are framed as RFC 5424 messages: one per datagram
+    // on datagram sockets, octet-counted (RFC 6587) on stream sockets.
+    class SocketSink : public Sink {
+
+    public:
+        SocketSink(SocketType type, std::string const & address, bool syslogFraming = false,
+                   std::size_t maxDatagram = 8192,
+                   std::chrono::milliseconds flushInterval = std::chrono::milliseconds(50))
+            : type_(type), syslogFraming_(syslogFraming), maxDatagram_(maxDatagram),
+              flushInterval_(flushInterval), addrLen_(0), fd_(-1), partialFrame_(false),
+              stop_(false), dropped_(0) {
+            char hostName[256] = {};
+            if (gethostname(hostName, sizeof(hostName) - 1) == 0 && hostName[0] != '\0') {
+                hostName_ = hostName;
+            } else {
+                hostName_ = "-";
+            }
+            valid_ = resolve_(address);
+            if (valid_) {
+                connect_();
+                flusher_ = std::thread(&SocketSink::run_, this);
+            }
+        }
+
+        ~SocketSink() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            flushCondition_.notify_all();
+            if (flusher_.joinable()) {
+                flusher_.join();
+            }
+            send_();
+            close_();
+        }
+
+        bool valid() const {
+            return valid_;
+        }
+
+        unsigned long long dropped() const {
+            return dropped_.load();
+        }
+
+        void write(Record const & record) {
+            auto frame = frame_(record);
+            std::lock_guard<std::mutex> lock(mutex_);
+            append_(frame);
+        }
+
+        void write_batch(Batch const & batch) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::size_t i = 0; i < batch.records.size(); ++i) {
+                append_(syslogFraming_ ? frame_(batch.records[i]) : batch.line(i) + "\n");
+            }
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (fd_ < 0) {
+                connect_();
+            }
+            send_();
+        }
+
+    private:
+        SocketType type_;
+        bool syslogFraming_;
+        bool valid_;
+        std::size_t maxDatagram_;
+        std::chrono::milliseconds flushInterval_;
+        std::string hostName_;
+        sockaddr_storage addr_;
+        socklen_t addrLen_;
+        int fd_;
+        std::string pending_;
+        std::vector<std::size_t> pendingEnds_; // Where each record in pending_ ends
+        bool partialFrame_; // Whether pending_ starts with the rest of a partially sent frame
+        bool stop_;
+        std::atomic<unsigned long long> dropped_;
+        std::mutex mutex_;
+        std::condition_variable flushCondition_;
+        std::thread flusher_;
+
+        bool one_per_datagram_() const {
+            return syslogFraming_ && type_ != SocketType::unix_stream;
+        }
+
+        bool resolve_(std::string const & address) {
+            std::memset(&addr_, 0, sizeof(addr_));
+            if (type_ != SocketType::udp) {
+                auto unixAddr = reinterpret_cast<sockaddr_un *>(&addr_);
+                if (address.empty() || address.size() >= sizeof(unixAddr->sun_path)) {
+                    return false;
+                }
+                unixAddr->sun_family = AF_UNIX;
+                std::memcpy(unixAddr->sun_path, address.c_str(), address.size());
+                addrLen_ = sizeof(sockaddr_un);
+                return true;
+            }
+            // UDP addresses are "host:port", with IPv6 hosts in brackets
+            auto separator = address.rfind(':');
+            if (separator == std::string::npos || separator == 0) {
+                return false;
+            }
+            auto host = address.substr(0, separator);
+            auto port = address.substr(separator + 1);
+            if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+                host = host.substr(1, host.size() - 2);
+            }
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_DGRAM;
+            hints.ai_flags = AI_NUMERICSERV;
+            addrinfo * result = nullptr;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr) {
+                return false;
+            }
+            std::memcpy(&addr_, result->ai_addr, result->ai_addrlen);
+            addrLen_ = result->ai_addrlen;
+            freeaddrinfo(result);
+            return true;
+        }
+
+        // Must be called with mutex_ held (or before the flusher thread exists)
+        void connect_() {
+            auto socketType = type_ == SocketType::unix_stream ? SOCK_STREAM : SOCK_DGRAM;
+            auto fd = socket(addr_.ss_family, socketType, 0);
+            if (fd < 0) {
+                return;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (connect(fd, reinterpret_cast<sockaddr *>(&addr_), addrLen_) != 0) {
+                ::close(fd);
+                return;
+            }
+            fd_ = fd;
+        }
+
+        void close_() {
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        void drop_pending_() {
+            dropped_ += pendingEnds_.size();
+            pending_.clear();
+            pendingEnds_.clear();
+            partialFrame_ = false;
+        }
+
+        // Must be called with mutex_ held. Never blocks: whatever cannot be handed
+        // to the kernel right now is dropped and counted.
+        void send_() {
+            if (pending_.empty()) {
+                return;
+            }
+            if (fd_ < 0) {
+                drop_pending_();
+                return;
+            }
+            auto sent = ::send(fd_, pending_.data(), pending_.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0) {
+                auto error = errno;
+                auto partialFrame = partialFrame_;
+                drop_pending_();
+                // Either the collector went away, or it already has the start of a frame whose
+                // rest was just dropped and would misread everything after it. Starting a new
+                // connection (the flusher thread reconnects) gives it a clean stream.
+                if ((partialFrame || (error != EAGAIN && error != EWOULDBLOCK)) && type_ != SocketType::udp) {
+                    close_();
+                }
+            } else if (static_cast<std::size_t>(sent) < pending_.size()) {
+                // Only stream sockets send partially, keep the rest so framing stays intact
+                auto done = static_cast<std::size_t>(sent);
+                pending_.erase(0, done);
+                auto sentRecords = std::upper_bound(pendingEnds_.begin(), pendingEnds_.end(), done) - pendingEnds_.begin();
+                pendingEnds_.erase(pendingEnds_.begin(), pendingEnds_.begin() + sentRecords);
+                for (auto & end : pendingEnds_) {
+                    end -= done;
+                }
+                partialFrame_ = true;
+            } else {
+                pending_.clear();
+                pendingEnds_.clear();
+                partialFrame_ = false;
+            }
+        }
+
+        void run_() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_) {
+                flushCondition_.wait_for(lock, flushInterval_);
+                if (stop_) {
+                    break;
+                }
+                if (fd_ < 0) {
+                    connect_();
+                }
+                send_();
+            }
+        }
+
+        // Must be called with mutex_ held
+        void append_(std::string const & frame) {
+            if (!pending_.empty() && (one_per_datagram_() || pending_.size() + frame.size() > maxDatagram_)) {
+                send_();
+            }
+            pending_ += frame;
+            pendingEnds_.push_back(pending_.size());
+            if (one_per_datagram_() || pending_.size() >= maxDatagram_) {
+                send_();
+            }
+        }
+
+        std::string frame_(Record const & record) const {
+            if (!syslogFraming_) {
+                return record.text + "\n";
+            }
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                record.time.time_since_epoch()).count();
+            auto seconds = static_cast<std::time_t>(micros / 1000000);
+            std::tm utc;
+            gmtime_r(&seconds, &utc);
+            char timestamp[96];
+            std::snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+                utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+                static_cast<int>(micros % 1000000));
+            std::ostringstream oss;
+            oss << '<' << 8 + syslog_severity_(record.level) << ">1 " << timestamp << ' ' << hostName_
+                << " - " << process_id_() << " - ";
+            if (record.context) {
+                // Context fields go out as RFC 5424 structured data rather than in the message
+                oss << "[context@32473";
+                for (auto & field : record.context->fields) {
+                    oss << ' ' << sd_name_(field.first) << "=\"";
+                    for (auto c : field.second) {
+                        if (c == '"' || c == '\\' || c == ']') {
+                            oss << '\\';
+                        }
+                        oss << c;
+                    }
+                    oss << '"';
+                }
+                oss << ']';
+            } else {
+                oss << '-';
+            }
+            oss << ' ' << std::string(record.subLevel * 4, ' ') << record.message;
+            if (type_ == SocketType::unix_stream) {
+                auto message = oss.str();
+                return std::to_string(message.size()) + " " + message;
+            }
+            return oss.str();
+        }
+
+        // An RFC 5424 PARAM-NAME: 1 to 32 printable ASCII characters other than '=', ' ', ']'
+        // and '"', so other characters become '_'
+        static std::string sd_name_(std::string const & key) {
+            auto name = key.substr(0, 32);
+            for (auto & c : name) {
+                if (c <= ' ' || c > '~' || c == '=' || c == ']' || c == '"') {
+                    c = '_';
+                }
+            }
+            return name.empty() ? "_" : name;
+        }
+
+        static int syslog_severity_(std::string const & level) {
+            if (level == "fatal") {
+                return 2;
+            } else if (level == "error") {
+                return 3;
+            } else if (level == "warn") {
+                return 4;
+            } else if (level == "info") {
+                return 6;
+            } else {
+                return 7;
+            }
+        }
+
+    };
+
+    static bool add_socket(SocketType type, std::string const & address, bool syslogFraming = false) {
+        return update_config_([&](Config & config) {
+            return add_socket_(config, type, address, syslogFraming);
+        });
+    }
+
+    // Total number of records socket sinks had to drop because the collector was
+    // unreachable or not keeping up
+    static unsigned long long dropped_socket_records() {
+        unsigned long long dropped = 0;
+        ConfigReader config;
+        for (auto & sink : config->sinks) {
+            auto socketSink = dynamic_cast<SocketSink *>(sink.get());
+            if (socketSink) {
+                dropped += socketSink->dropped();
+            }
+        }
+        return dropped;
+    }
+#endif // MLOGGER_POSIX
+
+    // Writes completed scopes as Chrome trace events (a JSON array of "X" events),
+    // which can be loaded into chrome://tracing or Perfetto. Ordinary records are ignored.
+    class TraceFileSink : public Sink {
+
+    public:
+        explicit TraceFileSink(std::string const & fileName) : empty_(true) {
+            file_.open(fileName);
+            file_ << "[";
+        }
+
+        ~TraceFileSink() {
+            file_ << "\n]\n";
+        }
+
+        bool is_open() const {
+            return file_.is_open();
+        }
+
+        void write(Record const &) {}
+
+        bool wants_text() const {
+            return false;
+        }
+
+        void write_span(Span const & span) {
+            auto start = std::chrono::duration_cast<std::chrono::microseconds>(span.start.time_since_epoch());
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(span.duration);
+            std::lock_guard<std::mutex> lock(mutex_);
+            file_ << (empty_ ? "\n" : ",\n")
+                  << "{\"name\":\"" << json_escape_(span.name) << "\",\"cat\":\"" << span.level
+                  << "\",\"ph\":\"X\",\"ts\":" << start.count() << ",\"dur\":" << duration.count()
+                  << ",\"pid\":" << process_id_() << ",\"tid\":" << span.threadIndex;
+            if (span.context) {
+                const char * separator = ",\"args\":{";
+                for (auto & field : span.context->fields) {
+                    file_ << separator << '"' << json_escape_(field.first) << "\":\"" << json_escape_(field.second) << '"';
+                    separator = ",";
+                }
+                file_ << "}";
+            }
+            file_ << "}";
+            empty_ = false;
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            file_.flush();
+        }
+
+    private:
+        std::ofstream file_;
+        bool empty_;
+        std::mutex mutex_;
+
+    };
+
+    static bool add_trace_file(std::string const & fileName) {
+        return update_config_([&](Config & config) {
+            return add_trace_file_(config, fileName);
+        });
+    }
+
+#if defined(MLOGGER_POSIX)
+    // Gives every thread its own file, <prefix>.<n>.log, so threads never contend on a
+    // shared file offset. When a thread exits its file goes to the next new thread, so
+    // there are only as many files as threads logging at once. Each line is prefixed with a process wide sequence number
+    // and a nanosecond timestamp; merge_shards puts the shards back together in order.
+    // Shards are not flushed after every record, call flush() when that matters.
+    // Shards left under the same prefix by an earlier run are removed on construction,
+    // as merge_shards would otherwise mix them in.
+    class ShardedFileSink : public Sink {
+
+    public:
+        explicit ShardedFileSink(std::string const & prefix)
+            : prefix_(prefix), id_(next_id_()++), pool_(std::make_shared<Pool>()) {
+            for (auto & shard : shard_files_(prefix)) {
+                unlink(shard.c_str());
+            }
+        }
+
+        void write(Record const & record) {
+            auto shard = shard_();
+            if (shard == nullptr) {
+                return;
+            }
+            auto sequence = next_sequence_().fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(shard->mutex); // Only contended while flush() runs
+            write_line_(*shard, sequence, record, record.text);
+        }
+
+        // Takes consecutive sequence numbers for the whole batch, so it stays together when merged
+        void write_batch(Batch const & batch) {
+            auto shard = shard_();
+            if (shard == nullptr || batch.records.empty()) {
+                return;
+            }
+            auto sequence = next_sequence_().fetch_add(batch.records.size(), std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (std::size_t i = 0; i < batch.records.size(); ++i) {
+                write_line_(*shard, sequence + i, batch.records[i], batch.line(i));
+            }
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(pool_->mutex);
+            for (auto & shard : pool_->shards) {
+                std::lock_guard<std::mutex> shardLock(shard->mutex);
+                shard->file.flush();
+            }
+        }
+
+    private:
+        struct Shard {
+            std::mutex mutex;
+            std::ofstream file;
+        };
+
+        // Every shard the sink opened, and the ones no thread is using. Shared with the
+        // threads' leases, which may outlive the sink.
+        struct Pool {
+            std::mutex mutex; // Taken once per thread
+            std::vector<std::unique_ptr<Shard>> shards;
+            std::vector<Shard *> free;
+        };
+
+        struct Lease {
+            unsigned long id;
+            std::weak_ptr<Pool> pool;
+            Shard * shard; // Null if the shard could not be opened
+        };
+
+        // A thread's shards, handed back to their sinks when the thread exits
+        struct Leases {
+            std::vector<Lease> leases;
+
+            ~Leases() {
+                for (auto & lease : leases) {
+                    auto pool = lease.pool.lock();
+                    if (pool && lease.shard) {
+                        std::lock_guard<std::mutex> lock(pool->mutex);
+                        pool->free.push_back(lease.shard);
+                    }
+                }
+            }
+        };
+
+        std::string prefix_;
+        unsigned long id_;
+        std::shared_ptr<Pool> pool_;
+
+        static void write_line_(Shard & shard, unsigned long long sequence, Record const & record,
+                                std::string const & text) {
+            auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                record.time.time_since_epoch()).count();
+            shard.file << sequence << ' ' << timestamp << ' ' << text << '\n';
+        }
+
+        // The calling thread's shard: on its first record, one an exited thread handed back
+        // or else a new one
+        Shard * shard_() {
+            static thread_local Leases leases;
+            for (auto & lease : leases.leases) {
+                if (lease.id == id_) {
+                    return lease.shard;
+                }
+            }
+            Shard * result = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(pool_->mutex);
+                if (!pool_->free.empty()) {
+                    result = pool_->free.back();
+                    pool_->free.pop_back();
+                } else {
+                    std::unique_ptr<Shard> shard(new Shard);
+                    shard->file.open(prefix_ + "." + std::to_string(pool_->shards.size()) + ".log");
+                    if (shard->file.is_open()) {
+                        pool_->shards.push_back(std::move(shard));
+                        result = pool_->shards.back().get();
+                    }
+                }
+            }
+            // Drop the leases of sinks that are gone
+            leases.leases.erase(std::remove_if(leases.leases.begin(), leases.leases.end(), [](Lease const & lease) {
+                return lease.pool.expired();
+            }), leases.leases.end());
+            Lease lease = {id_, pool_, result};
+            leases.leases.push_back(lease);
+            return result;
+        }
+
+        // Sink ids are never reused, so thread local entries of destroyed sinks never match
+        static std::atomic<unsigned long> & next_id_() {
+            static std::atomic<unsigned long> id(0);
+            return id;
+        }
+
+        static std::atomic<unsigned long long> & next_sequence_() {
+            static std::atomic<unsigned long long> sequence(0);
+            return sequence;
+        }
+
+    };
+
+    static bool add_sharded_file(std::string const & prefix) {
+        return update_config_([&](Config & config) {
+            return add_sharded_file_(config, prefix);
+        });
+    }
+
+    // Merges the shards written by a ShardedFileSink back into one log, in the order the
+    // records were logged. Streams through the shards, holding one line per shard in memory.
+    // With keepStamps, lines keep their sequence number and timestamp prefix.
+    static bool merge_shards(std::string const & prefix, std::ostream & out, bool keepStamps = false) {
+        std::vector<std::unique_ptr<std::ifstream>> shards;
+        for (auto & name : shard_files_(prefix)) {
+            std::unique_ptr<std::ifstream> shard(new std::ifstream(name));
+            if (shard->is_open()) {
+                shards.push_back(std::move(shard));
+            }
+        }
+        if (shards.empty()) {
+            return false;
+        }
+        typedef std::pair<unsigned long long, std::size_t> Head; // Sequence number, shard
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+        std::vector<std::string> lines(shards.size());
+        auto next_line = [&](std::size_t shard) {
+            while (std::getline(*shards[shard], lines[shard])) {
+                unsigned long long sequence;
+                if (std::sscanf(lines[shard].c_str(), "%llu", &sequence) == 1) {
+                    heads.push(Head(sequence, shard));
+                    return;
+                }
+            }
+        };
+        for (std::size_t shard = 0; shard < shards.size(); ++shard) {
+            next_line(shard);
+        }
+        while (!heads.empty()) {
+            auto shard = heads.top().second;
+            heads.pop();
+            auto const & line = lines[shard];
+            if (keepStamps) {
+                out << line << '\n';
+            } else {
+                auto stampsEnd = line.find(' ', line.find(' ') + 1);
+                out << (stampsEnd == std::string::npos ? line : line.substr(stampsEnd + 1)) << '\n';
+            }
+            next_line(shard);
+        }
+        out.flush();
+        return true;
+    }
+
+#endif // MLOGGER_POSIX
+
+    // Writes records into a file of independently decodable compressed blocks, so a
+    // crash cannot damage what was already written. Records are collected into blocks of
+    // about blockSize bytes, which a background thread compresses and appends to the file,
+    // along with an entry in <fileName>.idx (block offset and time of its first record)
+    // that lets readers start in the middle; see decompress_file. A block is also written
+    // when flushInterval passes without it filling up. If the background thread falls
+    // maxPendingBlocks behind, callers wait for it instead of records being lost.
+    // A crash loses the records not yet on disk: the block being filled, the one being
+    // compressed and up to maxPendingBlocks sealed ones, so at most about
+    // (maxPendingBlocks + 2) * blockSize bytes (1.5 MiB by default); flush() writes them all.
+    //
+    // Block layout: "MLZ1", raw size, payload size and FNV-1a checksum of the raw data
+    // (little endian 32 bit each), then the payload: LZ4 style sequences, or the raw data
+    // itself when it did not compress (payload size == raw size).
+    class CompressedFileSink : public Sink {
+
+    public:
+        explicit CompressedFileSink(std::string const & fileName, std::size_t blockSize = 256 * 1024,
+                                    std::chrono::milliseconds flushInterval = std::chrono::milliseconds(1000),
+                                    std::size_t maxPendingBlocks = 4)
+            : blockSize_(blockSize), flushInterval_(flushInterval), maxPendingBlocks_(maxPendingBlocks),
+              busy_(false), stop_(false) {
+            file_.open(fileName, std::ios::binary);
+            index_.open(fileName + ".idx", std::ios::binary);
+            if (is_open()) {
+                compressor_ = std::thread(&CompressedFileSink::run_, this);
+            }
+        }
+
+        ~CompressedFileSink() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+                if (!current_.data.empty()) {
+                    pending_.push_back(std::move(current_));
+                }
+            }
+            workCondition_.notify_all();
+            if (compressor_.joinable()) {
+                compressor_.join();
+            }
+        }
+
+        bool is_open() const {
+            return file_.is_open() && index_.is_open();
+        }
+
+        void write(Record const & record) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (current_.data.empty()) {
+                current_.firstTime = record.time;
+            }
+            current_.data += record.text;
+            current_.data += '\n';
+            if (current_.data.size() >= blockSize_) {
+                seal_(lock);
+            }
+        }
+
+        void write_batch(Batch const & batch) {
+            if (batch.records.empty()) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (current_.data.empty()) {
+                current_.firstTime = batch.records.front().time;
+            }
+            current_.data += batch.text;
+            if (current_.data.size() >= blockSize_) {
+                seal_(lock);
+            }
+        }
+
+        // Seals the block being filled and waits until everything is on disk
+        void flush() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!current_.data.empty()) {
+                seal_(lock);
+            }
+            idleCondition_.wait(lock, [this] { return pending_.empty() && !busy_; });
+        }
+
+    private:
+        struct Block {
+            std::string data;
+            std::chrono::system_clock::time_point firstTime;
+        };
+
+        std::size_t blockSize_;
+        std::chrono::milliseconds flushInterval_;
+        std::size_t maxPendingBlocks_;
+        std::ofstream file_;  // Only touched by the compressor thread once it runs
+        std::ofstream index_; // Likewise
+        Block current_;
+        std::deque<Block> pending_;
+        bool busy_;
+        bool stop_;
+        std::mutex mutex_;
+        std::condition_variable workCondition_;
+        std::condition_variable spaceCondition_;
+        std::condition_variable idleCondition_;
+        std::thread compressor_;
+
+        void seal_(std::unique_lock<std::mutex> & lock) {
+            spaceCondition_.wait(lock, [this] { return pending_.size() < maxPendingBlocks_; });
+            pending_.push_back(std::move(current_));
+            current_.data.clear();
+            workCondition_.notify_one();
+        }
+
+        void run_() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                if (pending_.empty()) {
+                    if (stop_) {
+                        break;
+                    }
+                    if (!workCondition_.wait_for(lock, flushInterval_, [this] { return stop_ || !pending_.empty(); })
+                        && !current_.data.empty()) {
+                        pending_.push_back(std::move(current_));
+                        current_.data.clear();
+                    }
+                    continue;
+                }
+                auto block = std::move(pending_.front());
+                pending_.pop_front();
+                busy_ = true;
+                spaceCondition_.notify_all();
+                lock.unlock();
+                write_block_(block);
+                lock.lock();
+                busy_ = false;
+                idleCondition_.notify_all();
+            }
+        }
+
+        void write_block_(Block const & block) {
+            auto compressed = lz_compress_(block.data);
+            auto const & payload = compressed.size() < block.data.size() ? compressed : block.data;
+            std::string header = "MLZ1";
+            put_le_(header, block.data.size(), 4);
+            put_le_(header, payload.size(), 4);
+            put_le_(header, fnv1a_(block.data), 4);
+            std::string entry;
+            put_le_(entry, static_cast<std::uint64_t>(file_.tellp()), 8);
+            put_le_(entry, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                block.firstTime.time_since_epoch()).count()), 8);
+            file_.write(header.data(), header.size());
+            file_.write(payload.data(), payload.size());
+            file_.flush();
+            index_.write(entry.data(), entry.size());
+            index_.flush();
+        }
+
+    };
+
+    static bool add_compressed_file(std::string const & fileName) {
+        return update_config_([&](Config & config) {
+            return add_compressed_file_(config, fileName);
+        });
+    }
+
+    // Writes the records of a CompressedFileSink file to out. When from is given, the block
+    // index is used to skip straight to the last block that started at or before it.
+    // A block cut short by a crash ends the output; false means the file is damaged.
+    static bool decompress_file(std::string const & fileName, std::ostream & out,
+                                std::chrono::system_clock::time_point from = std::chrono::system_clock::time_point()) {
+        std::ifstream file(fileName, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::uint64_t offset = 0;
+        if (from != std::chrono::system_clock::time_point()) {
+            auto fromNs = std::chrono::duration_cast<std::chrono::nanoseconds>(from.time_since_epoch()).count();
+            std::ifstream index(fileName + ".idx", std::ios::binary);
+            char entry[16];
+            while (index.read(entry, sizeof(entry))) {
+                if (static_cast<long long>(get_le_(entry + 8, 8)) > fromNs) {
+                    break;
+                }
+                offset = get_le_(entry, 8);
+            }
+        }
+        file.seekg(static_cast<std::streamoff>(offset));
+        char header[16];
+        std::string payload;
+        std::string raw;
+        while (file.read(header, sizeof(header))) {
+            if (std::memcmp(header, "MLZ1", 4) != 0) {
+                return false;
+            }
+            auto rawSize = static_cast<std::size_t>(get_le_(header + 4, 4));
+            auto payloadSize = static_cast<std::size_t>(get_le_(header + 8, 4));
+            payload.resize(payloadSize);
+            if (!file.read(&payload[0], payloadSize)) {
+                break;
+            }
+            if (payloadSize == rawSize) {
+                raw = payload;
+            } else if (!lz_decompress_(payload, rawSize, raw)) {
+                return false;
+            }
+            if (fnv1a_(raw) != get_le_(header + 12, 4)) {
+                return false;
+            }
+            out.write(raw.data(), raw.size());
+        }
+        out.flush();
+        return true;
+    }
+
+    // Writes records to a file exactly like add_file, plus a sidecar index in
+    // <fileName>.index that query_file uses to read only the parts of the file it needs.
+    // Records are grouped into blocks, which end at every new second of wall clock time
+    // or after blockSize bytes; each block gets one index entry: its byte offset and size,
+    // a bitmap of the levels in it and the times of its first and last records (64, 32,
+    // 32, 64 and 64 bits, little endian). Entries are written as blocks end and on flush().
+    class IndexedFileSink : public Sink {
+
+    public:
+        explicit IndexedFileSink(std::string const & fileName, std::size_t blockSize = 64 * 1024)
+            : blockSize_(blockSize), offset_(0), blockOpen_(false), blockStart_(0), blockLevels_(0),
+              blockFirst_(0), blockLast_(0) {
+            file_.open(fileName);
+            index_.open(fileName + ".index", std::ios::binary);
+        }
+
+        ~IndexedFileSink() {
+            end_block_();
+        }
+
+        bool is_open() const {
+            return file_.is_open() && index_.is_open();
+        }
+
+        void write(Record const & record) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            append_(record, record.text);
+            file_.flush();
+        }
+
+        void write_batch(Batch const & batch) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::size_t i = 0; i < batch.records.size(); ++i) {
+                append_(batch.records[i], batch.line(i));
+            }
+            file_.flush();
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            end_block_();
+            file_.flush();
+            index_.flush();
+        }
+
+    private:
+        std::size_t blockSize_;
+        std::ofstream file_;
+        std::ofstream index_;
+        std::uint64_t offset_;
+        bool blockOpen_;
+        std::uint64_t blockStart_;
+        unsigned blockLevels_;
+        long long blockFirst_;
+        long long blockLast_;
+        std::mutex mutex_;
+
+        // Must be called with mutex_ held
+        void append_(Record const & record, std::string const & text) {
+            long long time = std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+            if (blockOpen_ && (time / 1000000000 != blockFirst_ / 1000000000 || offset_ - blockStart_ >= blockSize_)) {
+                end_block_();
+            }
+            if (!blockOpen_) {
+                blockOpen_ = true;
+                blockStart_ = offset_;
+                blockLevels_ = 0;
+                blockFirst_ = blockLast_ = time;
+            }
+            blockLevels_ |= level_bit_(record.level);
+            blockFirst_ = std::min(blockFirst_, time);
+            blockLast_ = std::max(blockLast_, time);
+            file_ << text << '\n';
+            offset_ += text.size() + 1;
+        }
+
+        void end_block_() {
+            if (!blockOpen_) {
+                return;
+            }
+            std::string entry;
+            put_le_(entry, blockStart_, 8);
+            put_le_(entry, offset_ - blockStart_, 4);
+            put_le_(entry, blockLevels_, 4);
+            put_le_(entry, static_cast<std::uint64_t>(blockFirst_), 8);
+            put_le_(entry, static_cast<std::uint64_t>(blockLast_), 8);
+            index_.write(entry.data(), entry.size());
+            blockOpen_ = false;
+        }
+
+    };
+
+#if defined(MLOGGER_POSIX)
+    // Writes the records of an indexed file (see add_file) logged between from and to, at
+    // one of the given levels (all levels when empty). Only blocks whose index entry matches
+    // are read, through mmap. Time filtering is per block, so at the edges of the range it is
+    // accurate to the second. Records past the last index entry, e.g. after a crash, have no
+    // known time and are returned if to is open ended.
+    static bool query_file(std::string const & fileName, std::ostream & out,
+                           std::chrono::system_clock::time_point from = std::chrono::system_clock::time_point::min(),
+                           std::chrono::system_clock::time_point to = std::chrono::system_clock::time_point::max(),
+                           std::vector<std::string> const & levels = std::vector<std::string>()) {
+        unsigned levelMask = levels.empty() ? ~0u : 0u;
+        for (auto const & level : levels) {
+            levelMask |= level_bit_(level);
+        }
+        auto fromNs = from == std::chrono::system_clock::time_point::min() ? std::numeric_limits<long long>::min()
+            : static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(from.time_since_epoch()).count());
+        auto toNs = to == std::chrono::system_clock::time_point::max() ? std::numeric_limits<long long>::max()
+            : static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(to.time_since_epoch()).count());
+        std::ifstream index(fileName + ".index", std::ios::binary);
+        auto fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!index.is_open() || fd < 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        auto size = static_cast<std::uint64_t>(info.st_size);
+        char const * data = nullptr;
+        if (size > 0) {
+            auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            data = static_cast<char const *>(mapping);
+        }
+        ::close(fd);
+        auto write_lines = [&](std::uint64_t begin, std::uint64_t end) {
+            while (begin < end) {
+                auto lineEnd = static_cast<char const *>(std::memchr(data + begin, '\n', end - begin));
+                auto next = lineEnd ? static_cast<std::uint64_t>(lineEnd - data) + 1 : end;
+                std::string line(data + begin, next - begin);
+                auto levelEnd = line.find("] : ");
+                auto levelStart = levelEnd == std::string::npos ? std::string::npos : line.rfind('[', levelEnd);
+                if (levelStart != std::string::npos
+                    && (levelMask & level_bit_(line.substr(levelStart + 1, levelEnd - levelStart - 1)))) {
+                    out << line;
+                }
+                begin = next;
+            }
+        };
+        std::uint64_t indexedEnd = 0;
+        char entry[32];
+        while (index.read(entry, sizeof(entry))) {
+            auto offset = get_le_(entry, 8);
+            auto end = offset + get_le_(entry + 8, 4);
+            auto blockLevels = static_cast<unsigned>(get_le_(entry + 12, 4));
+            auto first = static_cast<long long>(get_le_(entry + 16, 8));
+            auto last = static_cast<long long>(get_le_(entry + 24, 8));
+            if (end > size) {
+                break;
+            }
+            indexedEnd = std::max(indexedEnd, end);
+            if ((blockLevels & levelMask) && last >= fromNs && first <= toNs) {
+                write_lines(offset, end);
+            }
+        }
+        if (toNs == std::numeric_limits<long long>::max()) {
+            write_lines(indexedEnd, size);
+        }
+        if (data != nullptr) {
+            munmap(const_cast<char *>(data), size);
+        }
+        out.flush();
+        return true;
+    }
+
+    // Layout of the shared memory ring used by ShmRingSink and ShmCollector: this header,
+    // followed by slotCount slots of slotSize bytes each.
+    struct ShmRingHeader {
+        char magic[8];
+        std::uint32_t slotCount;
+        std::uint32_t slotSize;
+        std::atomic<std::uint64_t> writeIndex;  // Next record index to be claimed by a producer
+        std::atomic<std::uint64_t> readIndex;   // Next record index the collector will read
+        std::atomic<std::uint64_t> overwritten; // Records overwritten before the collector read them
+    };
+
+    // A slot holds record index i once its sequence is 2 * i + 2 (2 * i + 1 while being written),
+    // so the collector can tell a finished record from one in progress or one overwritten.
+    struct ShmRingSlot {
+        std::atomic<std::uint64_t> sequence;
+        std::int64_t time; // Nanoseconds since the epoch
+        std::int32_t level;
+        std::int32_t subLevel;
+        std::uint32_t length;
+        char message[4]; // Runs to the end of the slot, longer messages are cut short
+    };
+
+    // Writes raw records (time, level, sub level and message, no formatting) into a POSIX
+    // shared memory ring, for ShmCollector in another process to render and store. Producers
+    // claim a slot each with one atomic increment and never wait for the collector: when the
+    // ring is full the oldest record is overwritten and counted in overwritten(). The ring
+    // outlives the sink so that a collector can still drain it, and a sink attaching to an
+    // existing ring of the same shape carries on from where it left off.
+    class ShmRingSink : public Sink {
+
+    public:
+        explicit ShmRingSink(std::string const & name, std::uint32_t slotCount = 4096, std::uint32_t slotSize = 512)
+            : header_(nullptr), size_(0) {
+            if (slotCount > 0 && slotSize >= sizeof(ShmRingSlot)) {
+                header_ = map_shm_ring_(name, slotCount, slotSize, size_);
+            }
+        }
+
+        ~ShmRingSink() {
+            if (header_ != nullptr) {
+                munmap(header_, size_);
+            }
+        }
+
+        bool is_open() const {
+            return header_ != nullptr;
+        }
+
+        bool wants_text() const {
+            return false;
+        }
+
+        unsigned long long overwritten() const {
+            return header_ ? header_->overwritten.load(std::memory_order_relaxed) : 0;
+        }
+
+        void write(Record const & record) {
+            if (header_ != nullptr) {
+                write_slot_(record, header_->writeIndex.fetch_add(1, std::memory_order_relaxed));
+            }
+        }
+
+        // Claims consecutive slots for the whole batch, so no other record lands in between
+        void write_batch(Batch const & batch) {
+            if (header_ == nullptr || batch.records.empty()) {
+                return;
+            }
+            auto index = header_->writeIndex.fetch_add(batch.records.size(), std::memory_order_relaxed);
+            for (auto & record : batch.records) {
+                write_slot_(record, index++);
+            }
+        }
+
+    private:
+        ShmRingHeader * header_;
+        std::size_t size_;
+
+        void write_slot_(Record const & record, std::uint64_t index) {
+            if (index >= header_->readIndex.load(std::memory_order_relaxed) + header_->slotCount) {
+                header_->overwritten.fetch_add(1, std::memory_order_relaxed);
+            }
+            auto & slot = shm_ring_slot_(header_, index);
+            slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.time = std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+            slot.level = level_index_(record.level);
+            slot.subLevel = record.subLevel;
+            // The ring has no room for structured fields, so the context travels as the prefix
+            auto room = header_->slotSize - offsetof(ShmRingSlot, message);
+            auto prefixLength = record.context ? std::min(record.context->prefix.size(), room) : 0;
+            if (prefixLength > 0) {
+                std::memcpy(slot.message, record.context->prefix.data(), prefixLength);
+            }
+            auto messageLength = std::min(record.message.size(), room - prefixLength);
+            std::memcpy(slot.message + prefixLength, record.message.data(), messageLength);
+            slot.length = static_cast<std::uint32_t>(prefixLength + messageLength);
+            slot.sequence.store(2 * index + 2, std::memory_order_release);
+        }
+
+    };
+
+    static bool add_shm_ring(std::string const & name) {
+        return update_config_([&](Config & config) {
+            return add_shm_ring_(config, name);
+        });
+    }
+
+    // Total number of records shared memory ring sinks overwrote before they were collected
+    static unsigned long long overwritten_shm_records() {
+        unsigned long long overwritten = 0;
+        ConfigReader config;
+        for (auto & sink : config->sinks) {
+            auto ringSink = dynamic_cast<ShmRingSink *>(sink.get());
+            if (ringSink) {
+                overwritten += ringSink->overwritten();
+            }
+        }
+        return overwritten;
+    }
+
+    // Reads the records a ShmRingSink in another process writes, rendering them in the same
+    // layout log() uses (with the standard time format). Progress is kept in the ring, so a
+    // restarted collector carries on where the previous one stopped.
+    class ShmCollector {
+
+    public:
+        explicit ShmCollector(std::string const & name) : header_(nullptr), size_(0), lost_(0) {
+            auto fd = shm_open(name.c_str(), O_RDWR, 0);
+            if (fd < 0) {
+                return;
+            }
+            struct stat info;
+            if (fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) >= sizeof(ShmRingHeader)) {
+                auto mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    auto header = static_cast<ShmRingHeader *>(mapping);
+                    if (std::memcmp(header->magic, "MLOGSHM1", 8) == 0
+                        && shm_ring_size_(header->slotCount, header->slotSize) <= static_cast<std::size_t>(info.st_size)) {
+                        header_ = header;
+                        size_ = info.st_size;
+                    } else {
+                        munmap(mapping, info.st_size);
+                    }
+                }
+            }
+            ::close(fd);
+        }
+
+        ~ShmCollector() {
+            if (header_ != nullptr) {
+                munmap(header_, size_);
+            }
+        }
+
+        bool is_open() const {
+            return header_ != nullptr;
+        }
+
+        // Records the producers overwrote before they could be read
+        unsigned long long overwritten() const {
+            return header_ ? header_->overwritten.load(std::memory_order_relaxed) : 0;
+        }
+
+        // Records this collector had to skip because they were overwritten or never finished
+        unsigned long long lost() const {
+            return lost_;
+        }
+
+        // Writes out every record finished since the last call, returns how many were written.
+        // A record still being written is waited for up to stallTimeout, in case its producer died.
+        std::size_t poll(std::ostream & out, std::chrono::milliseconds stallTimeout = std::chrono::milliseconds(100)) {
+            if (header_ == nullptr) {
+                return 0;
+            }
+            std::size_t written = 0;
+            auto cursor = header_->readIndex.load(std::memory_order_relaxed);
+            std::string message;
+            while (true) {
+                auto writeIndex = header_->writeIndex.load(std::memory_order_acquire);
+                if (cursor + header_->slotCount < writeIndex) {
+                    lost_ += writeIndex - header_->slotCount - cursor;
+                    cursor = writeIndex - header_->slotCount;
+                }
+                if (cursor == writeIndex) {
+                    break;
+                }
+                auto & slot = shm_ring_slot_(header_, cursor);
+                auto expected = 2 * cursor + 2;
+                auto sequence = slot.sequence.load(std::memory_order_acquire);
+                auto stallStart = std::chrono::steady_clock::now();
+                while (sequence < expected && std::chrono::steady_clock::now() - stallStart < stallTimeout) {
+                    std::this_thread::yield();
+                    sequence = slot.sequence.load(std::memory_order_acquire);
+                }
+                if (sequence == expected) {
+                    auto time = slot.time;
+                    auto level = slot.level;
+                    auto subLevel = slot.subLevel;
+                    auto length = std::min<std::size_t>(slot.length, header_->slotSize - offsetof(ShmRingSlot, message));
+                    message.assign(slot.message, length);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.sequence.load(std::memory_order_relaxed) == expected) {
+                        auto seconds = static_cast<std::time_t>(time / 1000000000);
+                        char timeText[64] = "";
+                        ctime_r(&seconds, timeText);
+                        timeText[std::strcspn(timeText, "\n")] = '\0';
+                        out << std::string(std::max(subLevel, 0) * 4, ' ') << timeText << " [" << level_name_(level)
+                            << "] : " << message << '\n';
+                        ++written;
+                    } else {
+                        ++lost_;
+                    }
+                } else {
+                    ++lost_;
+                }
+                ++cursor;
+                header_->readIndex.store(cursor, std::memory_order_release);
+            }
+            return written;
+        }
+
+    private:
+        ShmRingHeader * header_;
+        std::size_t size_;
+        unsigned long long lost_;
+
+    };
+
+    // Writes records to a file, and makes callers logging at durableLevel or above wait
+    // until their record is on stable storage. Syncs are shared: a background thread runs
+    // one fdatasync covering every record written by any thread so far, and records that
+    // arrive meanwhile wait for the next one, which starts no sooner than commitInterval
+    // after the last. By default that is as soon as the last one finishes; a longer
+    // interval makes fewer, bigger groups at the cost of latency.
+    // Records at durableLevel or above skip the async queue, so they hold up the caller in
+    // async mode too. A failed write or sync is never taken for success: the records it
+    // covered are reported through last_write_failed() and the failure counters.
+    class DurableFileSink : public Sink {
+
+    public:
+        explicit DurableFileSink(std::string const & fileName, std::string const & durableLevel = "error",
+                                 std::chrono::milliseconds commitInterval = std::chrono::milliseconds(0))
+            : durableIndex_(level_index_(durableLevel)), commitInterval_(commitInterval),
+              fd_(open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)), written_(0),
+              requested_(0), committed_(0), failedThrough_(0), commits_(0), failedCommits_(0), failedWrites_(0),
+              stop_(false) {
+            if (is_open()) {
+                committer_ = std::thread(&DurableFileSink::run_, this);
+            }
+        }
+
+        ~DurableFileSink() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+                requested_ = written_;
+            }
+            commitCondition_.notify_all();
+            if (committer_.joinable()) {
+                committer_.join();
+            }
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        bool is_open() const {
+            return fd_ >= 0;
+        }
+
+        bool waits_for(std::string const & level) const {
+            return level_index_(level) >= durableIndex_;
+        }
+
+        void write(Record const & record) {
+            write_(record.text + "\n", 1, level_index_(record.level) >= durableIndex_);
+        }
+
+        void write_batch(Batch const & batch) {
+            auto durable = std::any_of(batch.records.begin(), batch.records.end(), [this](Record const & record) {
+                return level_index_(record.level) >= durableIndex_;
+            });
+            write_(batch.text, batch.records.size(), durable);
+        }
+
+        // Waits until every record written so far is on stable storage
+        void flush() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wait_for_commit_(lock);
+        }
+
+        // Number of fdatasync calls made, and how many of them failed
+        unsigned long long commits() const {
+            return commits_.load();
+        }
+
+        unsigned long long failed_commits() const {
+            return failedCommits_.load();
+        }
+
+        // Number of records that could not be written at all, e.g. with the disk full
+        unsigned long long failed_writes() const {
+            return failedWrites_.load();
+        }
+
+        // Whether the last record at a durable level the calling thread wrote to a
+        // DurableFileSink failed to reach stable storage, because its write or sync failed
+        static bool last_write_failed() {
+            return last_write_failed_();
+        }
+
+    private:
+        int durableIndex_;
+        std::chrono::milliseconds commitInterval_;
+        int fd_;
+        unsigned long long written_;   // Records written to fd_
+        unsigned long long requested_;     // Records some caller is waiting to see synced
+        unsigned long long committed_;     // Records covered by a finished sync, failed or not
+        unsigned long long failedThrough_; // Records up to here were covered by a failed sync
+        std::atomic<unsigned long long> commits_;
+        std::atomic<unsigned long long> failedCommits_;
+        std::atomic<unsigned long long> failedWrites_;
+        bool stop_;
+        std::mutex mutex_;
+        std::condition_variable commitCondition_;
+        std::condition_variable syncedCondition_;
+        std::thread committer_;
+
+        void write_(std::string const & lines, std::size_t records, bool durable) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (std::size_t done = 0; done < lines.size();) {
+                auto result = ::write(fd_, lines.data() + done, lines.size() - done);
+                if (result > 0) {
+                    done += static_cast<std::size_t>(result);
+                } else if (result == 0 || errno != EINTR) {
+                    // Out of space or an I/O error: the records cannot be made durable
+                    failedWrites_ += records;
+                    if (durable) {
+                        last_write_failed_() = true;
+                    }
+                    return;
+                }
+            }
+            written_ += records;
+            if (durable) {
+                last_write_failed_() = !wait_for_commit_(lock);
+            }
+        }
+
+        // Returns whether everything written so far is on stable storage
+        bool wait_for_commit_(std::unique_lock<std::mutex> & lock) {
+            auto target = written_;
+            if (committed_ < target && committer_.joinable()) {
+                if (requested_ < target) {
+                    requested_ = target;
+                    commitCondition_.notify_one();
+                }
+                syncedCondition_.wait(lock, [&] { return committed_ >= target; });
+            }
+            // A later sync that succeeds does not make up for a failed one: the kernel may
+            // have dropped the pages it could not write
+            return committed_ >= target && failedThrough_ < target;
+        }
+
+        static bool & last_write_failed_() {
+            static thread_local bool failed = false;
+            return failed;
+        }
+
+        void run_() {
+            auto lastCommit = std::chrono::steady_clock::now() - commitInterval_;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                commitCondition_.wait(lock, [this] { return stop_ || requested_ > committed_; });
+                if (requested_ <= committed_) {
+                    break;
+                }
+                // Let more records join this commit, unless shutting down
+                commitCondition_.wait_until(lock, lastCommit + commitInterval_, [this] { return stop_; });
+                auto target = written_;
+                lock.unlock();
+                auto synced = sync_data_(fd_) == 0;
+                if (!synced) {
+                    ++failedCommits_;
+                }
+                ++commits_;
+                lastCommit = std::chrono::steady_clock::now();
+                lock.lock();
+                if (!synced) {
+                    failedThrough_ = target;
+                }
+                committed_ = target;
+                syncedCondition_.notify_all();
+            }
+        }
+
+    };
+
+    static bool add_durable_file(std::string const & fileName, std::string const & durableLevel = "error",
+                                 std::chrono::milliseconds commitInterval = std::chrono::milliseconds(0)) {
+        return update_config_([&](Config & config) {
+            return add_durable_file_(config, fileName, durableLevel, commitInterval);
+        });
+    }
+
+#endif // MLOGGER_POSIX
+
+    /***** level controls *****/
+    static bool add_level(std::string const & level) {
+        auto bit = level_bit_(level);
+        return bit != 0 && update_config_([&](Config & config) {
+            if (config.levelMask & bit) {
+                return false;
+            }
+            config.levelMask |= bit;
+            return true;
+        });
+    }
+
+    static bool add_levels(std::initializer_list<std::string> levels) {
+        auto result = true;
+        unsigned mask = 0;
+        for (auto const &level : levels) {
+            auto bit = level_bit_(level);
+            if (bit == 0 || (mask & bit)) {
+                result = false;
+            }
+            mask |= bit;
+        }
+        update_config_([&](Config & config) {
+            if (config.levelMask & mask) {
+                result = false;
+            }
+            config.levelMask |= mask;
+            return true;
+        });
+        return result;
+    }
+
+    static bool remove_level(std::string const & level) {
+        auto bit = level_bit_(level);
+        return bit != 0 && update_config_([&](Config & config) {
+            if (!(config.levelMask & bit)) {
+                return false;
+            }
+            config.levelMask &= ~bit;
+            return true;
+        });
+    }
+
+    static void clear_levels() {
+        update_config_([](Config & config) {
+            config.levelMask = 0;
+            return true;
+        });
+    }
+
+    // Enables the given level and every level below it, as a single change
+    static bool set_max_level(std::string const & level) {
+        auto mask = max_level_mask_(level);
+        return mask != 0 && update_config_([&](Config & config) {
+            config.levelMask = mask;
+            return true;
+        });
+    }
+
+    /***** live reconfiguration *****/
+    // Replaces levels and outputs with the ones described in a config file, e.g.
+    //     max_level = info        (or: levels = info, warn, error)
+    //     ostream = stdout        (stdout, stderr or clog)
+    //     file = app.log
+    //     indexed_file = app.log  (a file with a sidecar index, see add_file)
+    //     socket = unix_dgram /run/collector.sock syslog
+    //     trace_file = app.trace.json
+    //     sharded_file = app
+    //     compressed_file = app.log.mlz
+    //     shm_ring = /app.log
+    //     durable_file = audit.log (error and fatal wait for fdatasync, see add_durable_file)
+    // Lines starting with # are ignored. Levels are only replaced if the file sets them,
+    // outputs only if it lists any; outputs that are still listed are kept open, and
+    // sinks added with add_sink are always kept. The change is swapped in at once:
+    // log() calls already running on other threads finish with the old outputs.
+    static bool load_config(std::string const & fileName) {
+        std::ifstream file(fileName);
+        if (!file.is_open()) {
+            return false;
+        }
+        auto hasLevels = false;
+        unsigned levelMask = 0;
+        std::vector<std::pair<std::string, std::string>> outputs;
+        std::string line;
+        while (std::getline(file, line)) {
+            line = trim_(line.substr(0, line.find('#')));
+            if (line.empty()) {
+                continue;
+            }
+            auto separator = line.find('=');
+            if (separator == std::string::npos) {
+                return false;
+            }
+            auto key = trim_(line.substr(0, separator));
+            auto value = trim_(line.substr(separator + 1));
+            if (key == "levels") {
+                hasLevels = true;
+                std::istringstream levels(value);
+                std::string level;
+                while (std::getline(levels, level, ',')) {
+                    auto bit = level_bit_(trim_(level));
+                    if (bit == 0) {
+                        return false;
+                    }
+                    levelMask |= bit;
+                }
+            } else if (key == "max_level") {
+                hasLevels = true;
+                auto mask = max_level_mask_(value);
+                if (mask == 0) {
+                    return false;
+                }
+                levelMask |= mask;
+            } else if (key == "ostream" || key == "file" || key == "indexed_file" || key == "socket"
+                       || key == "trace_file" || key == "sharded_file" || key == "compressed_file"
+                       || key == "shm_ring" || key == "durable_file") {
+                outputs.emplace_back(key, value);
+            } else {
+                return false;
+            }
+        }
+        return update_config_([&](Config & config) {
+            if (hasLevels) {
+                config.levelMask = levelMask;
+            }
+            if (!outputs.empty()) {
+                auto previous = config;
+                config.ostreamWrappers.clear();
+                config.ostreamMutexes.clear();
+                config.ostreamPtrs.clear();
+                config.fileMutexes.clear();
+                config.fileNames.clear();
+                config.sinks.clear();
+                config.sinkNames.clear();
+                for (std::size_t i = 0; i < previous.sinks.size(); ++i) {
+                    if (previous.sinkNames[i].empty()) {
+                        add_sink_(config, "", previous.sinks[i]);
+                    }
+                }
+                for (auto const & output : outputs) {
+                    if (!add_output_(config, previous, output.first, output.second)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        });
+    }
+
+#if defined(MLOGGER_POSIX)
+    // Loads the config file now and again whenever it is rewritten (on Linux, where
+    // it is watched with inotify) or the process receives reloadSignal (e.g. SIGHUP,
+    // 0 for none). Reloading happens on a background thread. stop_watching_config puts
+    // back the handler reloadSignal had before.
+    static bool watch_config(std::string const & fileName, int reloadSignal = 0) {
+        stop_watching_config();
+        if (!load_config(fileName)) {
+            return false;
+        }
+        auto & self = instance_();
+        if (pipe(self.watchPipe_) != 0) {
+            return false;
+        }
+        for (auto fd : self.watchPipe_) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        fcntl(self.watchPipe_[1], F_SETFL, fcntl(self.watchPipe_[1], F_GETFL) | O_NONBLOCK);
+        auto inotifyFd = -1;
+#if defined(__linux__)
+        auto slash = fileName.rfind('/');
+        auto directory = slash == std::string::npos ? std::string(".") : fileName.substr(0, slash + 1);
+        inotifyFd = inotify_init1(IN_CLOEXEC);
+        if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            ::close(inotifyFd);
+            inotifyFd = -1;
+        }
+#endif
+        if (reloadSignal != 0) {
+            reload_fd_().store(self.watchPipe_[1]);
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_handler = &on_reload_signal_;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART;
+            if (sigaction(reloadSignal, &action, &self.previousAction_) != 0) {
+                reload_fd_().store(-1);
+                if (inotifyFd >= 0) {
+                    ::close(inotifyFd);
+                }
+                ::close(self.watchPipe_[0]);
+                ::close(self.watchPipe_[1]);
+                self.watchPipe_[0] = self.watchPipe_[1] = -1;
+                return false;
+            }
+            self.reloadSignal_ = reloadSignal;
+        }
+        self.configWatcher_ = std::thread(&MLogger::watch_config_, fileName, inotifyFd);
+        return true;
+    }
+
+    static void stop_watching_config() {
+        instance_().stop_watching_config_();
+    }
+#endif // MLOGGER_POSIX
+
+    /***** asynchronous logging *****/
+    // In async mode log() renders records on the calling thread and leaves writing them to a
+    // background thread. Every level has its own queue and the most severe ones are written
+    // first, while each thread's records still come out in the order it logged them. Once
+    // more than capacity records below error are queued, further ones are dropped and
+    // counted; error and fatal are never dropped, and fatal is written by the calling
+    // thread, after everything queued before it.
+    static void set_async(bool enabled, std::size_t capacity = 65536) {
+        auto & self = instance_();
+        AsyncQueue * asyncQueue = nullptr;
+        update_config_([&](Config & config) {
+            if (enabled && !self.asyncQueue_) {
+                self.asyncQueue_.reset(new AsyncQueue);
+            }
+            asyncQueue = self.asyncQueue_.get();
+            if (asyncQueue) {
+                asyncQueue->set_capacity(capacity);
+            }
+            config.async = enabled;
+            return true;
+        });
+        if (!enabled && asyncQueue) {
+            asyncQueue->drain();
+        }
+    }
+
+    static unsigned long long dropped_async_records() {
+        auto & asyncQueue = instance_().asyncQueue_;
+        return asyncQueue ? asyncQueue->dropped() : 0;
+    }
+
+    /***** backpressure *****/
+    // Sheds the least severe levels when outputs fall behind, instead of slowing down
+    // callers. Every checkInterval, the mean write time of the slowest output and the async
+    // queue depth are compared against their watermarks (a high watermark of 0 leaves that
+    // measure unwatched). Above either high watermark the minimum level is raised a step,
+    // first dropping trace and debug, then info; warn and above are never shed. Levels come
+    // back a step at a time once both are under their low watermarks. Every step is logged
+    // as a warn, and degradations are counted in backpressure_degradations().
+    struct Backpressure {
+        std::chrono::microseconds highLatency;
+        std::chrono::microseconds lowLatency;
+        std::size_t highQueueDepth;
+        std::size_t lowQueueDepth;
+        std::chrono::milliseconds checkInterval;
+    };
+
+    static void set_backpressure(Backpressure const & backpressure) {
+        update_config_([&](Config & config) {
+            config.backpressure = std::make_shared<Backpressure const>(backpressure);
+            return true;
+        });
+    }
+
+    // Stops watching the outputs and restores any shed levels
+    static void clear_backpressure() {
+        update_config_([&](Config & config) {
+            config.backpressure.reset();
+            return true;
+        });
+        auto & self = instance_();
+        self.shedStep_ = 0;
+        self.shedMask_ = 0;
+        self.probeDue_ = false;
+    }
+
+    static unsigned long long backpressure_degradations() {
+        return instance_().degradations_.load();
+    }
+
+    static unsigned long long shed_records() {
+        return instance_().shedRecords_.load();
+    }
+
+    /***** format controls *****/
+    struct TimeGetter {
+        // Returns the current time formatted as a std::string
+        virtual std::string operator() () {
+            return "";
+        }
+    };
+
+    struct StlTimeGetter : public TimeGetter {
+        std::string operator() () {
+            // Same layout as std::ctime, which is not safe to call from several threads
+            auto currTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+            std::tm local;
+#if defined(_WIN32)
+            localtime_s(&local, &currTime);
+#else
+            localtime_r(&currTime, &local);
+#endif
+            char currTimeStr[64];
+            return std::string(currTimeStr, std::strftime(currTimeStr, sizeof(currTimeStr), "%a %b %e %H:%M:%S %Y", &local));
+        }
+    };
+
+    // Uses timeGetter without taking ownership: it must outlive its use,
+    // until reset_time_getter or another set_time_getter
+    template <class TG, class = typename std::enable_if<std::is_base_of<TimeGetter, TG>::value>::type>
+    static void set_time_getter(TG & timeGetter) {
+        set_time_getter(std::shared_ptr<TimeGetter>(&timeGetter, [](TimeGetter *) {}));
+    }
+
+    static void set_time_getter(std::shared_ptr<TimeGetter> const & timeGetter) {
+        update_config_([&](Config & config) {
+            config.timeGetter = timeGetter;
+            return true;
+        });
+    }
+
+    static void reset_time_getter() {
+        set_time_getter(std::make_shared<StlTimeGetter>());
+    }
+
+    /***** logging *****/
+    static void blank_line() {
+        ConfigReader config;
+        if (config->async) {
+            instance_().asyncQueue_->drain();
+        }
+        for (std::size_t i = 0; i < config->ostreamWrappers.size(); ++i) {
+            std::lock_guard<std::mutex> lock(*config->ostreamMutexes[i]);
+            config->ostreamWrappers[i].get() << std::endl;
+        }
+        for (std::size_t i = 0; i < config->ostreamPtrs.size(); ++i) {
+            std::lock_guard<std::mutex> lock(*config->fileMutexes[i]);
+            *config->ostreamPtrs[i] << std::endl;
+        }
+    }
+
+    static void log(std::string const & level, std::string const & message, int const & subLevel = 0) {
+        ConfigReader config;
+        if (!message.empty() && (config->levelMask & level_bit_(level))) {
+            auto & self = instance_();
+            if (config->backpressure && (self.shedMask_.load(std::memory_order_relaxed) & level_bit_(level))
+                && !(self.probeDue_.load(std::memory_order_relaxed) && self.probeDue_.exchange(false))) {
+                ++self.shedRecords_;
+                check_backpressure_(*config);
+                return;
+            }
+            auto effectiveSubLevel = subLevel + scope_depth_();
+            auto context = current_context_();
+            Record record = {level, message, effectiveSubLevel, std::chrono::system_clock::now(), "", context};
+            if (config->renderText) {
+                auto additionalWhitespace = std::string(effectiveSubLevel * 4, ' ');
+                std::ostringstream oss;
+                oss << additionalWhitespace << get_time_() << " [" + level + "] : ";
+                if (context) {
+                    oss << context->prefix;
+                }
+                oss << message;
+                record.text = oss.str();
+            }
+            if (!config->async) {
+                write_record_(*config, record);
+            } else if (level != "fatal" && !(config->waitLevelMask & level_bit_(level))) {
+                self.asyncQueue_->push(std::move(record));
+            } else {
+                // Everything queued so far goes out first, then fatal (or a record a sink makes
+                // the caller wait for) is written before returning
+                self.asyncQueue_->drain();
+                write_record_(*config, record);
+                if (level == "fatal") {
+                    flush();
+                }
+            }
+            last_message_() = message;
+        }
+    }
+
+    static void trace(std::string const & message, int const & subLevel = 0) {
+        log("trace", message, subLevel);
+    }
+
+    static void debug(std::string const & message, int const & subLevel = 0) {
+        log("debug", message, subLevel);
+    }
+
+    static void info(std::string const & message, int const & subLevel = 0) {
+        log("info", message, subLevel);
+    }
+
+    static void warn(std::string const & message, int const & subLevel = 0) {
+        log("warn", message, subLevel);
+    }
+
+    static void error(std::string const & message, int const & subLevel = 0) {
+        log("error", message, subLevel);
+    }
+
+    static void fatal(std::string const & message, int const & subLevel = 0) {
+        log("fatal", message, subLevel);
+    }
+
+    /***** for stream logging *****/
+    class stream {
+
+    public:
+        stream() {}
+
+        ~stream() {
+            MLogger::log(level_, stream_.str(), subLevel_);
+        }
+
+        std::ostringstream& trace(int const & subLevel = 0) {
+            level_ = "trace";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+        std::ostringstream& debug(int const & subLevel = 0) {
+            level_ = "debug";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+        std::ostringstream& info(int const & subLevel = 0) {
+            level_ = "info";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+        std::ostringstream& warn(int const & subLevel = 0) {
+            level_ = "warn";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+        std::ostringstream& error(int const & subLevel = 0) {
+            level_ = "error";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+        std::ostringstream& fatal(int const & subLevel = 0) {
+            level_ = "fatal";
+            subLevel_ = subLevel;
+            return stream_;
+        }
+
+    private:
+        std::string level_;
+        int subLevel_;
+        std::ostringstream stream_;
+
+    };
+
+    /***** scoped spans *****/
+    // Logs entry and exit of the enclosing block, indenting everything logged
+    // on this thread in between by one more sub level, and reports the elapsed
+    // time to the log and to any span sinks (see add_trace_file). When the level
+    // is not enabled, a scope costs a single level check.
+    class scope {
+
+    public:
+        explicit scope(std::string const & name, std::string const & level = "trace")
+            : enabled_(is_added_level_(level)) {
+            if (enabled_) {
+                name_ = name;
+                level_ = level;
+                MLogger::log(level_, "-> " + name_);
+                ++scope_depth_();
+                start_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~scope() {
+            if (enabled_) {
+                auto duration = std::chrono::steady_clock::now() - start_;
+                auto depth = --scope_depth_();
+                std::ostringstream oss;
+                oss << "<- " << name_ << " ("
+                    << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us)";
+                MLogger::log(level_, oss.str());
+                Span span = {name_, level_, depth, thread_index_(), start_, duration, current_context_()};
+                ConfigReader config;
+                for (auto & sink : config->sinks) {
+                    sink->write_span(span);
+                }
+            }
+        }
+
+        scope(scope const &) = delete;
+        scope & operator=(scope const &) = delete;
+
+    private:
+        bool enabled_;
+        std::string name_;
+        std::string level_;
+        std::chrono::steady_clock::time_point start_;
+
+    };
+
+    /***** diagnostic context *****/
+    // Tags everything the calling thread logs with key=value fields until the returned guard
+    // goes out of scope, e.g. auto request = MLogger::context::push("req", id);
+    // Pushes nest, and must be popped in reverse order. The prefix spliced into each line is
+    // rendered once per push, so logging under a context only reads a thread local pointer.
+    // Sinks can also get the fields themselves from Record::context.
+    class context {
+
+    public:
+        static context push(std::string const & key, std::string const & value) {
+            return context(key, value);
+        }
+
+        context(context && other) : context_(std::move(other.context_)), previous_(other.previous_) {}
+
+        ~context() {
+            if (context_) {
+                current_context_() = previous_;
+            }
+        }
+
+        context(context const &) = delete;
+        context & operator=(context const &) = delete;
+
+        // The fields in effect on the calling thread, outermost first
+        static std::vector<std::pair<std::string, std::string>> fields() {
+            auto current = current_context_();
+            return current ? current->fields : std::vector<std::pair<std::string, std::string>>();
+        }
+
+    private:
+        context(std::string const & key, std::string const & value)
+            : context_(std::make_shared<Context>()), previous_(current_context_()) {
+            auto & fields = std::const_pointer_cast<Context>(context_)->fields;
+            if (previous_) {
+                fields = previous_->fields;
+            }
+            fields.emplace_back(key, value);
+            std::string prefix = "[";
+            for (auto & field : fields) {
+                prefix += (prefix.size() > 1 ? " " : "") + field.first + "=" + field.second;
+            }
+            std::const_pointer_cast<Context>(context_)->prefix = prefix + "] ";
+            current_context_() = context_.get();
+        }
+
+        std::shared_ptr<Context const> context_;
+        Context const * previous_; // Kept alive by the enclosing guard
+
+    };
+
+    /***** batches *****/
+    // Collects records and writes them out together on commit(), e.g.
+    //     MLogger::batch summaries;
+    //     for (auto & item : items) summaries.info(item.summary());
+    //     summaries.commit();
+    // Levels and outputs are looked up once per commit, and so is the time unless
+    // timePerRecord (then each record keeps the time it was added). The records are
+    // rendered into one buffer that every ostream and file gets in a single write, without
+    // colour. ostreams, files and the sinks in this header keep a batch together, so no
+    // other thread's records end up in between; sinks added with add_sink only do if they
+    // override Sink::write_batch. A batch still holding records when it is destroyed
+    // commits them.
+    class batch {
+
+    public:
+        explicit batch(bool timePerRecord = false) : timePerRecord_(timePerRecord) {}
+
+        ~batch() {
+            commit();
+        }
+
+        batch(batch const &) = delete;
+        batch & operator=(batch const &) = delete;
+
+        void log(std::string const & level, std::string const & message, int const & subLevel = 0) {
+            if (message.empty() || level_bit_(level) == 0) {
+                return;
+            }
+            auto context = current_context_();
+            Record record = {level, message, subLevel + scope_depth_(), std::chrono::system_clock::time_point(), "",
+                             context};
+            if (timePerRecord_) {
+                record.time = std::chrono::system_clock::now();
+                times_.push_back(get_time_());
+            }
+            if (context && (contexts_.empty() || contexts_.back().get() != context)) {
+                contexts_.push_back(context->shared_from_this());
+            }
+            records_.push_back(std::move(record));
+        }
+
+        void trace(std::string const & message, int const & subLevel = 0) {
+            log("trace", message, subLevel);
+        }
+
+        void debug(std::string const & message, int const & subLevel = 0) {
+            log("debug", message, subLevel);
+        }
+
+        void info(std::string const & message, int const & subLevel = 0) {
+            log("info", message, subLevel);
+        }
+
+        void warn(std::string const & message, int const & subLevel = 0) {
+            log("warn", message, subLevel);
+        }
+
+        void error(std::string const & message, int const & subLevel = 0) {
+            log("error", message, subLevel);
+        }
+
+        void fatal(std::string const & message, int const & subLevel = 0) {
+            log("fatal", message, subLevel);
+        }
+
+        // Number of records waiting to be committed
+        std::size_t size() const {
+            return records_.size();
+        }
+
+        void commit() {
+            if (records_.empty()) {
+                return;
+            }
+            auto committed = std::make_shared<Batch>();
+            ConfigReader config;
+            auto & self = instance_();
+            auto shedMask = config->backpressure ? self.shedMask_.load(std::memory_order_relaxed) : 0u;
+            auto now = std::chrono::system_clock::now();
+            auto time = !timePerRecord_ && config->renderText ? get_time_() : "";
+            auto lane = 0;
+            unsigned levels = 0;
+            for (std::size_t i = 0; i < records_.size(); ++i) {
+                auto & record = records_[i];
+                auto bit = level_bit_(record.level);
+                if (!(config->levelMask & bit)) {
+                    continue;
+                } else if (shedMask & bit) {
+                    ++self.shedRecords_;
+                    continue;
+                }
+                if (!timePerRecord_) {
+                    record.time = now;
+                }
+                if (config->renderText) {
+                    auto & text = committed->text;
+                    text.append(record.subLevel * 4, ' ');
+                    text += timePerRecord_ ? times_[i] : time;
+                    text += " [" + record.level + "] : ";
+                    if (record.context) {
+                        text += record.context->prefix;
+                    }
+                    text += record.message;
+                    text += '\n';
+                    committed->ends.push_back(text.size());
+                }
+                lane = std::max(lane, level_index_(record.level));
+                levels |= bit;
+                committed->records.push_back(std::move(record));
+            }
+            committed->contexts = std::move(contexts_);
+            records_.clear();
+            times_.clear();
+            contexts_.clear();
+            if (committed->records.empty()) {
+                return;
+            }
+            last_message_() = committed->records.back().message;
+            if (!config->async) {
+                write_batch_(*config, *committed);
+            } else if (lane < level_index_("fatal") && !(config->waitLevelMask & levels)) {
+                self.asyncQueue_->push(committed, lane);
+            } else {
+                self.asyncQueue_->drain();
+                write_batch_(*config, *committed);
+                if (lane == level_index_("fatal")) {
+                    flush();
+                }
+            }
+        }
+
+    private:
+        bool timePerRecord_;
+        std::vector<Record> records_;
+        std::vector<std::string> times_; // Rendered time of each record, with timePerRecord
+        std::vector<std::shared_ptr<Context const>> contexts_; // Keeps the records' contexts alive until commit
+
+    };
+
+    /***** retrieve last logged message *****/
+    // The last message the calling thread logged. Kept per thread, so logging never
+    // contends on it.
+    static std::string last_message() {
+        return last_message_();
+    }
+
+private:
+    typedef void (*Log)(std::string const &);
+
+    // Levels and outputs in effect. A published Config is never modified: changes are
+    // made to a copy which is then swapped in, so log() can read it without locking.
+    struct Config {
+        unsigned levelMask;
+        std::vector<std::reference_wrapper<std::ostream>> ostreamWrappers;
+        std::vector<std::shared_ptr<std::mutex>> ostreamMutexes; // Serialises writes to each of ostreamWrappers
+        std::vector<std::shared_ptr<std::ostream>> ostreamPtrs;
+        std::vector<std::shared_ptr<std::mutex>> fileMutexes; // Likewise for each of ostreamPtrs
+        std::vector<std::string> fileNames; // File name behind each of ostreamPtrs
+        std::vector<std::shared_ptr<Sink>> sinks;
+        std::vector<std::string> sinkNames; // Config file line for each of sinks, empty if there is none
+        bool async; // Whether log() hands records to asyncQueue_
+        std::shared_ptr<Backpressure const> backpressure; // Null unless outputs are being watched
+        std::shared_ptr<TimeGetter> timeGetter;
+        bool renderText; // Whether any output uses Record::text
+        unsigned waitLevelMask; // Levels some sink makes callers wait for (see Sink::waits_for)
+    };
+
+    // The Config version a thread is reading, 0 while it reads none
+    typedef std::atomic<unsigned long> ReaderSlot;
+
+    // Gives access to the current Config. Each thread caches a pointer to the Config it
+    // last saw and only goes back to the shared copy (taking a lock once) after a change
+    // was swapped in. The cache does not own the Config: while the outermost reader on a
+    // thread is alive, the thread publishes the version it uses in its ReaderSlot, and
+    // update_config_ only releases replaced Configs that no slot still needs. A nested
+    // reader may refresh to a newer Config; the outer reader's one stays alive regardless.
+    class ConfigReader {
+
+    public:
+        ConfigReader() : cache_(cache_instance_()) {
+            auto & self = instance_();
+            if (cache_.readers == 0) {
+                // Announce before checking, so update_config_ either sees the announcement
+                // or we see its new version
+                cache_.slot->store(cache_.version);
+                if (self.configVersion_.load() != cache_.version) {
+                    refresh_(true);
+                }
+            } else if (self.configVersion_.load(std::memory_order_acquire) != cache_.version) {
+                refresh_(false);
+            }
+            ++cache_.readers;
+            config_ = cache_.config;
+        }
+
+        ~ConfigReader() {
+            if (--cache_.readers == 0) {
+                cache_.slot->store(0, std::memory_order_release);
+            }
+        }
+
+        ConfigReader(ConfigReader const &) = delete;
+        ConfigReader & operator=(ConfigReader const &) = delete;
+
+        Config const * operator->() const {
+            return config_;
+        }
+
+        Config const & operator*() const {
+            return *config_;
+        }
+
+    private:
+        struct Cache {
+            unsigned long version;
+            int readers;
+            Config const * config; // Only valid while version is current or announced in slot
+            std::shared_ptr<ReaderSlot> slot;
+        };
+
+        Cache & cache_;
+        Config const * config_;
+
+        void refresh_(bool announce) {
+            auto & self = instance_();
+            std::lock_guard<std::mutex> lock(self.configMutex_);
+            cache_.config = self.config_.get();
+            cache_.version = self.configVersion_.load(std::memory_order_relaxed);
+            if (announce) {
+                cache_.slot->store(cache_.version);
+            }
+        }
+
+        static Cache & cache_instance_() {
+            static thread_local Cache cache = {0, 0, nullptr, register_reader_()};
+            return cache;
+        }
+
+    };
+
+    // Background writer for async mode, with one lane per level. The writer always takes
+    // the head of the most severe non-empty lane, preceded by any earlier records the same
+    // thread has waiting in less severe lanes. Entries live in a FIFO per thread and lanes
+    // only refer to them, so pulling those earlier records forward never searches: they are
+    // at the front of the thread's FIFO, and their references in other lanes are skipped
+    // when they reach the front of those.
+    class AsyncQueue {
+
+    public:
+        AsyncQueue() : capacity_(0), queued_(0), queuedBelowError_(0), nextTicket_(0), unwrittenTicket_(0),
+                       stop_(false), dropped_(0) {
+            writer_ = std::thread(&AsyncQueue::run_, this);
+        }
+
+        ~AsyncQueue() {
+            stop();
+        }
+
+        // Writes out everything still queued, then stops the writer thread
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            workCondition_.notify_all();
+            if (writer_.joinable()) {
+                writer_.join();
+            }
+        }
+
+        void set_capacity(std::size_t capacity) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            capacity_ = capacity;
+        }
+
+        unsigned long long dropped() const {
+            return dropped_.load();
+        }
+
+        void push(Record record) {
+            auto lane = level_index_(record.level);
+            // Queued records may outlive the context guard they were logged under
+            std::shared_ptr<Context const> context;
+            if (record.context) {
+                context = record.context->shared_from_this();
+            }
+            Entry entry = {std::move(record), std::move(context), nullptr, next_sequence_(), lane, 0};
+            push_(std::move(entry), 1);
+        }
+
+        // Queues a committed batch as a single entry in the lane of its most severe record
+        void push(std::shared_ptr<Batch const> const & batch, int lane) {
+            Entry entry = {Record(), nullptr, batch, next_sequence_(), lane, 0};
+            push_(std::move(entry), batch->records.size());
+        }
+
+        std::size_t depth() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return queued_;
+        }
+
+        // Waits until everything queued so far has been written. Records queued after the
+        // call are not waited for, so other threads logging on cannot hold it up.
+        void drain() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto cutOff = nextTicket_;
+            idleCondition_.wait(lock, [this, cutOff] { return unwrittenTicket_ >= cutOff; });
+        }
+
+    private:
+        struct Entry {
+            Record record;
+            std::shared_ptr<Context const> context;
+            std::shared_ptr<Batch const> batch; // Set instead of record for a committed batch
+            unsigned long long sequence; // Order of the record among its thread's records
+            int lane;
+            unsigned long long ticket; // Order among all queued entries, see drain()
+        };
+
+        // Where an entry waits in a lane: the thread whose FIFO holds it, and its sequence
+        struct LaneRef {
+            unsigned thread;
+            unsigned long long sequence;
+        };
+
+        void push_(Entry entry, std::size_t records) {
+            auto thread = thread_index_();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (entry.lane < errorLane_) {
+                    if (queuedBelowError_ >= capacity_) {
+                        dropped_ += records;
+                        return;
+                    }
+                    ++queuedBelowError_;
+                }
+                ++queued_;
+                entry.ticket = nextTicket_++;
+                written_.push_back(false);
+                LaneRef ref = {thread, entry.sequence};
+                lanes_[entry.lane].push_back(ref);
+                threads_[thread].push_back(std::move(entry));
+            }
+            workCondition_.notify_one();
+        }
+
+        // Order of the calling thread's entries among themselves
+        static unsigned long long next_sequence_() {
+            static thread_local unsigned long long sequence = 0;
+            return ++sequence;
+        }
+
+        static const int laneCount_ = 6;
+        static const int errorLane_ = 4;
+
+        std::size_t capacity_;
+        std::deque<LaneRef> lanes_[laneCount_];
+        std::unordered_map<unsigned, std::deque<Entry>> threads_; // Queued entries of each thread, in order
+        std::size_t queued_;
+        std::size_t queuedBelowError_;
+        unsigned long long nextTicket_;
+        unsigned long long unwrittenTicket_; // Every entry before this one has been written
+        std::deque<bool> written_; // Whether each entry from unwrittenTicket_ on has been written
+        bool stop_;
+        std::atomic<unsigned long long> dropped_;
+        std::mutex mutex_;
+        std::condition_variable workCondition_;
+        std::condition_variable idleCondition_;
+        std::thread writer_;
+
+        void run_() {
+            std::vector<Entry> batch;
+            std::vector<unsigned long long> tickets;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                workCondition_.wait(lock, [this] { return stop_ || queued_ > 0; });
+                if (queued_ == 0) {
+                    break;
+                }
+                while (queued_ > 0 && batch.size() < 256) {
+                    take_next_(batch);
+                }
+                lock.unlock();
+                {
+                    ConfigReader config;
+                    for (auto const & entry : batch) {
+                        if (entry.batch) {
+                            write_batch_(*config, *entry.batch);
+                        } else {
+                            write_record_(*config, entry.record);
+                        }
+                    }
+                }
+                for (auto const & entry : batch) {
+                    tickets.push_back(entry.ticket);
+                }
+                batch.clear();
+                lock.lock();
+                for (auto ticket : tickets) {
+                    written_[ticket - unwrittenTicket_] = true;
+                }
+                tickets.clear();
+                auto advanced = false;
+                while (!written_.empty() && written_.front()) {
+                    written_.pop_front();
+                    ++unwrittenTicket_;
+                    advanced = true;
+                }
+                if (advanced) {
+                    idleCondition_.notify_all();
+                }
+            }
+        }
+
+        // Must be called with mutex_ held and queued_ > 0
+        void take_next_(std::vector<Entry> & batch) {
+            for (auto lane = laneCount_ - 1; lane >= 0; --lane) {
+                auto & refs = lanes_[lane];
+                while (!refs.empty()) {
+                    auto ref = refs.front();
+                    refs.pop_front();
+                    auto thread = threads_.find(ref.thread);
+                    if (thread == threads_.end() || thread->second.front().sequence > ref.sequence) {
+                        continue; // Already taken along with a later record of its thread
+                    }
+                    auto & entries = thread->second;
+                    while (!entries.empty() && entries.front().sequence <= ref.sequence) {
+                        --queued_;
+                        if (entries.front().lane < errorLane_) {
+                            --queuedBelowError_;
+                        }
+                        batch.push_back(std::move(entries.front()));
+                        entries.pop_front();
+                    }
+                    if (entries.empty()) {
+                        threads_.erase(thread);
+                    }
+                    if (queued_ == 0) {
+                        // Whatever references are left point at entries already taken
+                        for (auto & stale : lanes_) {
+                            stale.clear();
+                        }
+                    }
+                    return;
+                }
+            }
+        }
+
+    };
+
+    MLogger() : configVersion_(1), reaping_(false), stopReaping_(false), reloadSignal_(0), shedStep_(0),
+                shedMask_(0), probeDue_(false), latencyTotal_(0), latencySamples_(0), nextBackpressureCheck_(0),
+                degradations_(0), shedRecords_(0) {
+        config_ = std::make_shared<Config>(Config{0, {}, {}, {}, {}, {}, {}, {}, false, nullptr,
+                                                   std::make_shared<StlTimeGetter>(), false, 0});
+        watchPipe_[0] = watchPipe_[1] = -1;
+    }
+
+    ~MLogger() {
+#if defined(MLOGGER_POSIX)
+        stop_watching_config_();
+#endif
+        {
+            std::lock_guard<std::mutex> lock(readersMutex_);
+            stopReaping_ = true;
+        }
+        if (configReaper_.joinable()) {
+            configReaper_.join();
+        }
+        // The writer thread can still reach asyncQueue_ through check_backpressure_
+        if (asyncQueue_) {
+            asyncQueue_->stop();
+        }
+        asyncQueue_.reset();
+    }
+
+    std::shared_ptr<Config const> config_;
+    std::atomic<unsigned long> configVersion_;
+    std::mutex configMutex_; // Guards config_
+    std::mutex updateMutex_; // Serialises changes to config_
+    std::mutex readersMutex_; // Guards readerSlots_, retired_, reaping_ and stopReaping_
+    std::vector<std::shared_ptr<ReaderSlot>> readerSlots_; // One per thread that has read the Config
+    std::vector<std::pair<unsigned long, std::shared_ptr<Config const>>> retired_; // By version
+    std::thread configReaper_; // Releases the retired Configs that were still in use
+    bool reaping_;
+    bool stopReaping_;
+    std::thread configWatcher_;
+    int watchPipe_[2];
+    int reloadSignal_;
+#if defined(MLOGGER_POSIX)
+    struct sigaction previousAction_; // reloadSignal_'s handler before watch_config
+#endif
+    std::unique_ptr<AsyncQueue> asyncQueue_; // Created the first time async mode is enabled
+    std::atomic<int> shedStep_; // How many steps backpressure has raised the minimum level
+    std::atomic<unsigned> shedMask_; // Levels shed at that step
+    std::atomic<bool> probeDue_; // Whether the next shed record is written, to measure the outputs
+    std::atomic<long long> latencyTotal_; // Slowest output write times since the last check, in ns
+    std::atomic<unsigned long long> latencySamples_;
+    std::atomic<long long> nextBackpressureCheck_; // steady_clock time, in ns
+    std::atomic<unsigned long long> degradations_;
+    std::atomic<unsigned long long> shedRecords_;
+    std::ostringstream streamer_;
+    Log streamerLogger_;
+
+    static std::string & last_message_() {
+        static thread_local std::string message;
+        return message;
+    }
+
+    static MLogger& instance_() {
+        static MLogger instance;
+        return instance;
     }
 
-    static void clear_ostreams() {
-        while (!instance_().ostreamWrappers_.empty()) {
-            instance_().ostreamWrappers_.erase(instance_().ostreamWrappers_.begin());
+    // Applies update to a copy of the current Config and swaps the copy in,
+    // unless update returns false
+    static bool update_config_(std::function<bool (Config &)> const & update) {
+        auto & self = instance_();
+        std::lock_guard<std::mutex> updateLock(self.updateMutex_);
+        auto config = std::make_shared<Config>(*self.config_);
+        if (!update(*config)) {
+            return false;
         }
-        while (!instance_().ostreamPtrs_.empty()) {
-            instance_().ostreamPtrs_.erase(instance_().ostreamPtrs_.begin());
+        config->renderText = !config->ostreamWrappers.empty() || !config->ostreamPtrs.empty()
+            || std::any_of(config->sinks.begin(), config->sinks.end(), [](std::shared_ptr<Sink> const & sink) {
+                   return sink->wants_text();
+               });
+        config->waitLevelMask = 0;
+        for (auto & sink : config->sinks) {
+            for (auto level = 0; level < 6; ++level) {
+                if (sink->waits_for(level_name_(level))) {
+                    config->waitLevelMask |= 1u << level;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(self.configMutex_);
+            std::lock_guard<std::mutex> readersLock(self.readersMutex_);
+            self.retired_.emplace_back(self.configVersion_.load(std::memory_order_relaxed), std::move(self.config_));
+            self.config_ = std::move(config);
+            self.configVersion_.fetch_add(1);
+        }
+        if (!release_configs_(false)) {
+            // A thread is still logging with a replaced Config; release it once it is done,
+            // so sinks are not torn down on that thread's hot path
+            std::thread finished;
+            {
+                std::lock_guard<std::mutex> lock(self.readersMutex_);
+                if (!self.reaping_ && !self.stopReaping_) {
+                    finished = std::move(self.configReaper_);
+                    self.reaping_ = true;
+                    self.configReaper_ = std::thread([] {
+                        while (!release_configs_(true)) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        }
+                    });
+                }
+            }
+            if (finished.joinable()) {
+                finished.join();
+            }
         }
+        return true;
     }
 
-    static bool add_file(std::string const & fileName) {
-        auto file = std::make_shared<std::ofstream>();
-        file->open(fileName);
-        if (file->is_open() && !find_ostream_ptr_(*file)) {
-            instance_().ostreamPtrs_.push_back(file);
-            return true;
-        }
-        return false;
+    static std::shared_ptr<ReaderSlot> register_reader_() {
+        auto & self = instance_();
+        auto slot = std::make_shared<ReaderSlot>(0);
+        std::lock_guard<std::mutex> lock(self.readersMutex_);
+        self.readerSlots_.push_back(slot);
+        return slot;
     }
 
-    /***** level controls *****/
-    static bool add_level(std::string const & level) {
-        if (is_valid_level_(level)) {
-            return instance_().levels_.insert(level).second;
+    // Releases the retired Configs no reader still uses, outside any lock. Returns whether
+    // none are left (or the logger is shutting down), and then lets the reaper finish.
+    static bool release_configs_(bool reaper) {
+        auto & self = instance_();
+        std::vector<std::shared_ptr<Config const>> released;
+        std::lock_guard<std::mutex> lock(self.readersMutex_);
+        // A reader uses its announced version and possibly newer ones
+        auto oldest = std::numeric_limits<unsigned long>::max();
+        for (std::size_t i = 0; i < self.readerSlots_.size();) {
+            if (self.readerSlots_[i].use_count() == 1) {
+                // Its thread has exited
+                self.readerSlots_[i] = std::move(self.readerSlots_.back());
+                self.readerSlots_.pop_back();
+                continue;
+            }
+            auto version = self.readerSlots_[i]->load();
+            if (version != 0) {
+                oldest = std::min(oldest, version);
+            }
+            ++i;
+        }
+        auto firstReleased = std::partition(self.retired_.begin(), self.retired_.end(),
+                                   [&](std::pair<unsigned long, std::shared_ptr<Config const>> const & retired) {
+                                       return retired.first >= oldest;
+                                   });
+        for (auto it = firstReleased; it != self.retired_.end(); ++it) {
+            released.push_back(std::move(it->second));
         }
-        return false;
+        self.retired_.erase(firstReleased, self.retired_.end());
+        auto done = self.retired_.empty() || self.stopReaping_;
+        if (done && reaper) {
+            self.reaping_ = false;
+        }
+        return done; // released is destroyed after lock
     }
 
-    static bool add_levels(std::initializer_list<std::string> levels) {
-        auto result = true;
-        for (auto const &level : levels) {
-            if (!add_level(level)) {
-                result = false;
+    static void write_record_(Config const & config, Record const & record) {
+        auto colour = get_colour_(record.level);
+        WriteTimer timer(config.backpressure != nullptr);
+        for (std::size_t i = 0; i < config.ostreamWrappers.size(); ++i) {
+            {
+                std::lock_guard<std::mutex> lock(*config.ostreamMutexes[i]);
+                config.ostreamWrappers[i].get() << colour << record.text << termcolor::reset << std::endl;
             }
+            timer.lap();
         }
-        return result;
+        for (std::size_t i = 0; i < config.ostreamPtrs.size(); ++i) {
+            {
+                std::lock_guard<std::mutex> lock(*config.fileMutexes[i]);
+                *config.ostreamPtrs[i] << colour << record.text << termcolor::reset << std::endl;
+            }
+            timer.lap();
+        }
+        for (auto & sink : config.sinks) {
+            sink->write(record);
+            timer.lap();
+        }
+        observe_write_(config, timer);
     }
 
-    static bool remove_level(std::string const & level) {
-        return instance_().levels_.erase(level) == 1;
+    static void write_batch_(Config const & config, Batch const & batch) {
+        WriteTimer timer(config.backpressure != nullptr);
+        for (std::size_t i = 0; i < config.ostreamWrappers.size(); ++i) {
+            {
+                std::lock_guard<std::mutex> lock(*config.ostreamMutexes[i]);
+                config.ostreamWrappers[i].get().write(batch.text.data(), batch.text.size()).flush();
+            }
+            timer.lap();
+        }
+        for (std::size_t i = 0; i < config.ostreamPtrs.size(); ++i) {
+            {
+                std::lock_guard<std::mutex> lock(*config.fileMutexes[i]);
+                config.ostreamPtrs[i]->write(batch.text.data(), batch.text.size()).flush();
+            }
+            timer.lap();
+        }
+        for (auto & sink : config.sinks) {
+            sink->write_batch(batch);
+            timer.lap();
+        }
+        observe_write_(config, timer);
     }
 
-    static void clear_levels() {
-        instance_().levels_.clear();
-    }
+    // Times each output written to when backpressure is watching, and keeps the slowest
+    class WriteTimer {
 
-    static bool set_max_level(std::string const & level) {
-        auto result = false;
-        if (is_valid_level_(level)) {
-            result = true;
-            clear_levels();
-            if (!add_level(level)) {
-                result = false;
+    public:
+        explicit WriteTimer(bool enabled) : enabled_(enabled), slowest_(0) {
+            if (enabled_) {
+                last_ = std::chrono::steady_clock::now();
             }
-            if (level == "debug") {
-                if (!add_levels({"trace"})) {
-                    result = false;
-                }
-            } else if (level == "info") {
-                if (!add_levels({"trace", "debug"})) {
-                    result = false;
-                }
-            } else if (level == "warn") {
-                if (!add_levels({"trace", "debug", "info"})) {
-                    result = false;
-                }
-            } else if (level == "error") {
-                if (!add_levels({"trace", "debug", "info", "warn"})) {
-                    result = false;
-                }
-            } else if (level == "fatal") {
-                if (!add_levels({"trace", "debug", "info", "warn", "error"})) {
-                    result = false;
-                }
+        }
+
+        void lap() {
+            if (enabled_) {
+                auto now = std::chrono::steady_clock::now();
+                slowest_ = std::max(slowest_, now - last_);
+                last_ = now;
             }
         }
-        return result;
-    }
 
-    /***** format controls *****/
-    struct TimeGetter {
-        // Returns the current time formatted as a std::string
-        virtual std::string operator() () {
-            return "";
+        std::chrono::steady_clock::duration slowest() const {
+            return slowest_;
         }
+
+    private:
+        bool enabled_;
+        std::chrono::steady_clock::time_point last_;
+        std::chrono::steady_clock::duration slowest_;
+
     };
 
-    struct StlTimeGetter : public TimeGetter {
-        std::string operator() () {
-            auto currTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-            auto currTimeStr = std::string(std::ctime(&currTime));
-            return currTimeStr.erase(currTimeStr.size() - 1); // Remove newline character
+    static void observe_write_(Config const & config, WriteTimer const & timer) {
+        if (config.backpressure) {
+            auto & self = instance_();
+            self.latencyTotal_ += std::chrono::duration_cast<std::chrono::nanoseconds>(timer.slowest()).count();
+            ++self.latencySamples_;
+            check_backpressure_(config);
         }
-    };
+    }
 
-    template <class TG>
-    static void set_time_getter(TG & timeGetter) {
-        instance_().timeGetter_ = std::shared_ptr<TG>(&timeGetter);
+    // Moves the shed levels a step when a check is due (see set_backpressure).
+    // Only one thread per checkInterval gets past the first compare and exchange.
+    static void check_backpressure_(Config const & config) {
+        static thread_local bool checking = false;
+        auto & self = instance_();
+        auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        auto next = self.nextBackpressureCheck_.load(std::memory_order_relaxed);
+        auto & backpressure = *config.backpressure;
+        if (checking || now < next || !self.nextBackpressureCheck_.compare_exchange_strong(next,
+                now + std::chrono::duration_cast<std::chrono::nanoseconds>(backpressure.checkInterval).count())) {
+            return;
+        }
+        auto samples = self.latencySamples_.exchange(0);
+        auto total = self.latencyTotal_.exchange(0);
+        auto latency = std::chrono::nanoseconds(samples > 0 ? total / static_cast<long long>(samples) : 0);
+        // With nothing written since the last check (say, everything is being shed) the latency
+        // is unknown: hold the step, and let the next shed record through to measure it
+        auto watchLatency = backpressure.highLatency.count() > 0;
+        if (watchLatency && samples == 0) {
+            self.probeDue_ = true;
+        }
+        std::size_t depth = config.async ? self.asyncQueue_->depth() : 0;
+        auto over = (watchLatency && samples > 0 && latency > backpressure.highLatency)
+            || (backpressure.highQueueDepth > 0 && depth > backpressure.highQueueDepth);
+        auto under = (!watchLatency || (samples > 0 && latency < backpressure.lowLatency))
+            && (backpressure.highQueueDepth == 0 || depth < backpressure.lowQueueDepth);
+        auto step = self.shedStep_.load();
+        if (over && step < 2) {
+            ++step;
+            ++self.degradations_;
+        } else if (under && step > 0) {
+            --step;
+        } else {
+            return;
+        }
+        self.shedStep_ = step;
+        self.shedMask_ = step == 0 ? 0u : step == 1 ? level_bit_("trace") | level_bit_("debug")
+                                                    : level_bit_("trace") | level_bit_("debug") | level_bit_("info");
+        static char const * const shedLevels[] = {"nothing", "trace and debug", "trace, debug and info"};
+        std::ostringstream oss;
+        oss << "backpressure: now shedding " << shedLevels[step] << " (slowest output "
+            << std::chrono::duration_cast<std::chrono::microseconds>(latency).count() << " us per record, queue depth "
+            << depth << ")";
+        checking = true;
+        log("warn", oss.str());
+        checking = false;
+        // Writing the message above says nothing about how the outputs are doing
+        self.latencySamples_ = 0;
+        self.latencyTotal_ = 0;
     }
 
-    static void reset_time_getter() {
-        instance_().timeGetter_ = std::make_shared<StlTimeGetter>();
+    // The mutex serialising writes to stream. Every Config listing the stream shares it,
+    // even when the stream was removed and added again in between.
+    static std::shared_ptr<std::mutex> ostream_mutex_(std::ostream const & stream) {
+        static std::mutex registryMutex;
+        static std::unordered_map<std::ostream const *, std::weak_ptr<std::mutex>> registry;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto & entry = registry[&stream];
+        auto mutex = entry.lock();
+        if (!mutex) {
+            mutex = std::make_shared<std::mutex>();
+            entry = mutex;
+        }
+        return mutex;
     }
 
-    /***** logging *****/
-    static void blank_line() {
-        for (auto & ostreamWrapper : instance_().ostreamWrappers_) {
-            ostreamWrapper.get() << std::endl;
+    static bool find_ostream_wrapper_(Config const & config, std::ostream const & stream) {
+        return std::any_of(config.ostreamWrappers.begin(), config.ostreamWrappers.end(),
+            [&](std::reference_wrapper<std::ostream> const & wrapper) {
+                return &wrapper.get() == &stream;
+            });
+    }
+
+    static bool add_file_(Config & config, std::string const & fileName) {
+        if (std::find(config.fileNames.begin(), config.fileNames.end(), fileName) != config.fileNames.end()
+            || has_sink_name_(config, "indexed_file = " + fileName)) {
+            return false;
         }
-        for (auto & streamPtr : instance_().ostreamPtrs_) {
-            *streamPtr << std::endl;
+        auto file = std::make_shared<std::ofstream>();
+        file->open(fileName);
+        if (!file->is_open()) {
+            return false;
         }
+        config.ostreamPtrs.push_back(file);
+        config.fileMutexes.push_back(ostream_mutex_(*file));
+        config.fileNames.push_back(fileName);
+        return true;
     }
 
-    static void log(std::string const & level, std::string const & message, int const & subLevel = 0) {
-        if (!message.empty() && is_added_level_(level)) {
-            auto colour = get_colour_(level);
-            auto additionalWhitespace = std::string(subLevel * 4, ' ');
-            std::ostringstream oss;
-            oss << additionalWhitespace << get_time_() << " [" + level + "] : " << message;
-            for (auto & ostreamWrapper : instance_().ostreamWrappers_) {
-                ostreamWrapper.get() << colour << oss.str() << termcolor::reset << std::endl;
-            }
-            for (auto & streamPtr : instance_().ostreamPtrs_) {
-                *streamPtr << colour << oss.str() << termcolor::reset << std::endl;
-            }
-            instance_().lastMessage_ = message;
+    static bool add_sink_(Config & config, std::string const & name, std::shared_ptr<Sink> const & sink) {
+        if (!sink || std::find(config.sinks.begin(), config.sinks.end(), sink) != config.sinks.end()) {
+            return false;
+        }
+        if (!name.empty() && has_sink_name_(config, name)) {
+            return false;
         }
+        config.sinks.push_back(sink);
+        config.sinkNames.push_back(name);
+        return true;
     }
 
-    static void trace(std::string const & message, int const & subLevel = 0) {
-        log("trace", message, subLevel);
+    // Sinks that open a file must be checked with this before they are built: opening
+    // truncates the file a live sink of the same name is writing to
+    static bool has_sink_name_(Config const & config, std::string const & name) {
+        return std::find(config.sinkNames.begin(), config.sinkNames.end(), name) != config.sinkNames.end();
     }
 
-    static void debug(std::string const & message, int const & subLevel = 0) {
-        log("debug", message, subLevel);
+#if defined(MLOGGER_POSIX)
+    static std::string socket_name_(SocketType type, std::string const & address, bool syslogFraming) {
+        auto typeName = type == SocketType::unix_dgram ? "unix_dgram"
+                      : type == SocketType::unix_stream ? "unix_stream" : "udp";
+        return std::string("socket = ") + typeName + " " + address + (syslogFraming ? " syslog" : "");
     }
 
-    static void info(std::string const & message, int const & subLevel = 0) {
-        log("info", message, subLevel);
+    static bool add_socket_(Config & config, SocketType type, std::string const & address, bool syslogFraming) {
+        auto sink = std::make_shared<SocketSink>(type, address, syslogFraming);
+        return sink->valid() && add_sink_(config, socket_name_(type, address, syslogFraming), sink);
     }
 
-    static void warn(std::string const & message, int const & subLevel = 0) {
-        log("warn", message, subLevel);
+#endif // MLOGGER_POSIX
+
+    static bool add_trace_file_(Config & config, std::string const & fileName) {
+        auto name = "trace_file = " + fileName;
+        if (has_sink_name_(config, name)) {
+            return false;
+        }
+        auto sink = std::make_shared<TraceFileSink>(fileName);
+        return sink->is_open() && add_sink_(config, name, sink);
     }
 
-    static void error(std::string const & message, int const & subLevel = 0) {
-        log("error", message, subLevel);
+    static bool add_indexed_file_(Config & config, std::string const & fileName) {
+        auto name = "indexed_file = " + fileName;
+        if (has_sink_name_(config, name)
+            || std::find(config.fileNames.begin(), config.fileNames.end(), fileName) != config.fileNames.end()) {
+            return false;
+        }
+        auto sink = std::make_shared<IndexedFileSink>(fileName);
+        return sink->is_open() && add_sink_(config, name, sink);
     }
 
-    static void fatal(std::string const & message, int const & subLevel = 0) {
-        log("fatal", message, subLevel);
+    static bool add_compressed_file_(Config & config, std::string const & fileName) {
+        auto name = "compressed_file = " + fileName;
+        if (has_sink_name_(config, name)) {
+            return false;
+        }
+        auto sink = std::make_shared<CompressedFileSink>(fileName);
+        return sink->is_open() && add_sink_(config, name, sink);
     }
 
-    /***** for stream logging *****/
-    class stream {
+#if defined(MLOGGER_POSIX)
+    static bool add_sharded_file_(Config & config, std::string const & prefix) {
+        auto name = "sharded_file = " + prefix; // Building the sink removes the shards of a live one
+        return !prefix.empty() && !has_sink_name_(config, name)
+            && add_sink_(config, name, std::make_shared<ShardedFileSink>(prefix));
+    }
 
-    public:
-        stream() {}
+    static bool add_durable_file_(Config & config, std::string const & fileName, std::string const & durableLevel,
+                                  std::chrono::milliseconds commitInterval) {
+        auto name = "durable_file = " + fileName;
+        if (level_bit_(durableLevel) == 0 || has_sink_name_(config, name)) {
+            return false;
+        }
+        auto sink = std::make_shared<DurableFileSink>(fileName, durableLevel, commitInterval);
+        return sink->is_open() && add_sink_(config, name, sink);
+    }
 
-        ~stream() {
-            MLogger::log(level_, stream_.str(), subLevel_);
+    // fdatasync, or the closest equivalent where there is none
+    static int sync_data_(int fd) {
+#ifdef __APPLE__
+        return fcntl(fd, F_FULLFSYNC);
+#else
+        return fdatasync(fd);
+#endif
+    }
+
+    // The <prefix>.<number>.log files of a ShardedFileSink
+    static std::vector<std::string> shard_files_(std::string const & prefix) {
+        auto slash = prefix.rfind('/');
+        auto directory = slash == std::string::npos ? std::string(".") : prefix.substr(0, slash + 1);
+        auto baseName = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+        std::vector<std::string> shards;
+        auto dir = opendir(directory.c_str());
+        if (dir == nullptr) {
+            return shards;
+        }
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > baseName.size() + 5 && name.compare(0, baseName.size() + 1, baseName + ".") == 0
+                && name.compare(name.size() - 4, 4, ".log") == 0
+                && name.find_first_not_of("0123456789", baseName.size() + 1) == name.size() - 4) {
+                shards.push_back(slash == std::string::npos ? name : directory + name);
+            }
         }
+        closedir(dir);
+        return shards;
+    }
 
-        std::ostringstream& trace(int const & subLevel = 0) {
-            level_ = "trace";
-            subLevel_ = subLevel;
-            return stream_;
+    static bool add_shm_ring_(Config & config, std::string const & name) {
+        auto sinkName = "shm_ring = " + name;
+        if (has_sink_name_(config, sinkName)) {
+            return false;
         }
+        auto sink = std::make_shared<ShmRingSink>(name);
+        return sink->is_open() && add_sink_(config, sinkName, sink);
+    }
 
-        std::ostringstream& debug(int const & subLevel = 0) {
-            level_ = "debug";
-            subLevel_ = subLevel;
-            return stream_;
+    static std::size_t shm_ring_size_(std::uint32_t slotCount, std::uint32_t slotSize) {
+        return sizeof(ShmRingHeader) + static_cast<std::size_t>(slotCount) * slotSize;
+    }
+
+    static ShmRingSlot & shm_ring_slot_(ShmRingHeader * header, std::uint64_t index) {
+        auto slots = reinterpret_cast<char *>(header) + sizeof(ShmRingHeader);
+        return *reinterpret_cast<ShmRingSlot *>(slots + (index % header->slotCount) * header->slotSize);
+    }
+
+    // Opens the named ring, creating (or re-creating, if its shape differs) it as needed
+    static ShmRingHeader * map_shm_ring_(std::string const & name, std::uint32_t slotCount, std::uint32_t slotSize,
+                                         std::size_t & size) {
+        slotSize = (slotSize + 7) & ~7u; // Keeps every slot's sequence 8 byte aligned
+        size = shm_ring_size_(slotCount, slotSize);
+        auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat info;
+        auto existing = fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) == size;
+        if (!existing && ftruncate(fd, size) != 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        auto mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        auto header = static_cast<ShmRingHeader *>(mapping);
+        if (!existing || std::memcmp(header->magic, "MLOGSHM1", 8) != 0
+            || header->slotCount != slotCount || header->slotSize != slotSize) {
+            std::memset(mapping, 0, size);
+            header->slotCount = slotCount;
+            header->slotSize = slotSize;
+            new (&header->writeIndex) std::atomic<std::uint64_t>(0);
+            new (&header->readIndex) std::atomic<std::uint64_t>(0);
+            new (&header->overwritten) std::atomic<std::uint64_t>(0);
+            for (std::uint32_t i = 0; i < slotCount; ++i) {
+                new (&shm_ring_slot_(header, i).sequence) std::atomic<std::uint64_t>(0);
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(header->magic, "MLOGSHM1", 8);
+        }
+        return header;
+    }
+#endif // MLOGGER_POSIX
+
+    // Adds an output named in a config file, reusing it from previous if it is already open
+    static bool add_output_(Config & config, Config const & previous, std::string const & key, std::string const & value) {
+        if (key == "ostream") {
+            std::ostream * stream = value == "stdout" ? &std::cout
+                                  : value == "stderr" ? &std::cerr
+                                  : value == "clog" ? &std::clog : nullptr;
+            if (stream && !find_ostream_wrapper_(config, *stream)) {
+                config.ostreamWrappers.push_back(std::reference_wrapper<std::ostream>(*stream));
+                config.ostreamMutexes.push_back(ostream_mutex_(*stream));
+            }
+            return stream != nullptr;
+        } else if (key == "file") {
+            if (std::find(config.fileNames.begin(), config.fileNames.end(), value) != config.fileNames.end()) {
+                return true;
+            }
+            auto found = std::find(previous.fileNames.begin(), previous.fileNames.end(), value);
+            if (found == previous.fileNames.end()) {
+                return add_file_(config, value);
+            }
+            config.ostreamPtrs.push_back(previous.ostreamPtrs[found - previous.fileNames.begin()]);
+            config.fileMutexes.push_back(previous.fileMutexes[found - previous.fileNames.begin()]);
+            config.fileNames.push_back(value);
+            return true;
+        }
+        auto name = key + " = " + value;
+#if defined(MLOGGER_POSIX)
+        SocketType type = SocketType::udp;
+        std::string address;
+        auto syslogFraming = false;
+        if (key == "socket") {
+            std::istringstream words(value);
+            std::string typeName;
+            std::string framing;
+            words >> typeName >> address >> framing;
+            if (typeName == "unix_dgram") {
+                type = SocketType::unix_dgram;
+            } else if (typeName == "unix_stream") {
+                type = SocketType::unix_stream;
+            } else if (typeName != "udp") {
+                return false;
+            }
+            if (address.empty() || (!framing.empty() && framing != "syslog")) {
+                return false;
+            }
+            syslogFraming = !framing.empty();
+            name = socket_name_(type, address, syslogFraming);
+        }
+#endif
+        if (has_sink_name_(config, name)) {
+            return true;
+        }
+        auto found = std::find(previous.sinkNames.begin(), previous.sinkNames.end(), name);
+        if (found != previous.sinkNames.end()) {
+            return add_sink_(config, name, previous.sinks[found - previous.sinkNames.begin()]);
+        }
+        if (key == "trace_file") {
+            return add_trace_file_(config, value);
+        } else if (key == "indexed_file") {
+            return add_indexed_file_(config, value);
+        } else if (key == "compressed_file") {
+            return add_compressed_file_(config, value);
+        }
+#if defined(MLOGGER_POSIX)
+        if (key == "socket") {
+            return add_socket_(config, type, address, syslogFraming);
+        } else if (key == "sharded_file") {
+            return add_sharded_file_(config, value);
+        } else if (key == "shm_ring") {
+            return add_shm_ring_(config, value);
         }
+        return add_durable_file_(config, value, "error", std::chrono::milliseconds(0));
+#else
+        return false; // The remaining outputs need POSIX
+#endif
+    }
 
-        std::ostringstream& info(int const & subLevel = 0) {
-            level_ = "info";
-            subLevel_ = subLevel;
-            return stream_;
+    static std::string trim_(std::string const & text) {
+        auto first = text.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) {
+            return "";
         }
+        return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+    }
 
-        std::ostringstream& warn(int const & subLevel = 0) {
-            level_ = "warn";
-            subLevel_ = subLevel;
-            return stream_;
+#if defined(MLOGGER_POSIX)
+    // Write end of the config watcher's pipe, for the reload signal handler
+    static std::atomic<int> & reload_fd_() {
+        static std::atomic<int> fd(-1);
+        return fd;
+    }
+
+    static void on_reload_signal_(int) {
+        auto fd = reload_fd_().load();
+        if (fd >= 0) {
+            auto savedErrno = errno;
+            char command = 'r';
+            auto written = ::write(fd, &command, 1);
+            (void)written;
+            errno = savedErrno;
         }
+    }
 
-        std::ostringstream& error(int const & subLevel = 0) {
-            level_ = "error";
-            subLevel_ = subLevel;
-            return stream_;
+    static void watch_config_(std::string fileName, int inotifyFd) {
+        auto & self = instance_();
+        auto slash = fileName.rfind('/');
+        auto baseName = slash == std::string::npos ? fileName : fileName.substr(slash + 1);
+        pollfd fds[2] = {{self.watchPipe_[0], POLLIN, 0}, {inotifyFd, POLLIN, 0}};
+        auto stop = false;
+        while (!stop) {
+            if (poll(fds, inotifyFd >= 0 ? 2 : 1, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            auto reload = false;
+            if (fds[0].revents & POLLIN) {
+                char commands[64];
+                auto count = ::read(fds[0].fd, commands, sizeof(commands));
+                for (auto i = 0; i < count; ++i) {
+                    if (commands[i] == 's') {
+                        stop = true;
+                    } else {
+                        reload = true;
+                    }
+                }
+            }
+#if defined(__linux__)
+            if (inotifyFd >= 0 && (fds[1].revents & POLLIN)) {
+                alignas(inotify_event) char events[4096];
+                auto length = ::read(inotifyFd, events, sizeof(events));
+                for (auto offset = 0L; offset < length; ) {
+                    auto event = reinterpret_cast<inotify_event const *>(events + offset);
+                    if (event->len > 0 && baseName == event->name) {
+                        reload = true;
+                    }
+                    offset += sizeof(inotify_event) + event->len;
+                }
+            }
+#endif
+            if (reload && !stop) {
+                load_config(fileName);
+            }
         }
+        if (inotifyFd >= 0) {
+            ::close(inotifyFd);
+        }
+    }
 
-        std::ostringstream& fatal(int const & subLevel = 0) {
-            level_ = "fatal";
-            subLevel_ = subLevel;
-            return stream_;
+    void stop_watching_config_() {
+        if (!configWatcher_.joinable()) {
+            return;
         }
+        if (reloadSignal_ != 0) {
+            sigaction(reloadSignal_, &previousAction_, nullptr);
+            reload_fd_().store(-1);
+            reloadSignal_ = 0;
+        }
+        char command = 's';
+        auto written = ::write(watchPipe_[1], &command, 1);
+        (void)written;
+        configWatcher_.join();
+        ::close(watchPipe_[0]);
+        ::close(watchPipe_[1]);
+        watchPipe_[0] = watchPipe_[1] = -1;
+    }
+#endif // MLOGGER_POSIX
 
-    private:
-        std::string level_;
-        int subLevel_;
-        std::ostringstream stream_;
+    static long process_id_() {
+#if defined(_WIN32)
+        return _getpid();
+#else
+        return getpid();
+#endif
+    }
 
-    };
+    // Nesting depth of the scopes currently open on this thread
+    static int & scope_depth_() {
+        static thread_local int depth = 0;
+        return depth;
+    }
 
-    /***** retrieve last logged message *****/
-    static std::string last_message() {
-        return instance_().lastMessage_;
+    // Innermost diagnostic context pushed on the calling thread, owned by its context guard
+    static Context const * & current_context_() {
+        static thread_local Context const * current = nullptr;
+        return current;
     }
 
-private:
-    typedef void (*Log)(std::string const &);
+    // Small, stable number identifying the calling thread
+    static unsigned thread_index_() {
+        static std::atomic<unsigned> nextIndex(1);
+        static thread_local unsigned index = nextIndex++;
+        return index;
+    }
 
-    MLogger() {
-        timeGetter_ = std::make_shared<StlTimeGetter>();
+    static std::string json_escape_(std::string const & text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (auto c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
     }
 
-    std::vector<std::reference_wrapper<std::ostream>> ostreamWrappers_;
-    std::vector<std::shared_ptr<std::ostream>> ostreamPtrs_;
-    std::unordered_set<std::string> levels_;
-    std::shared_ptr<TimeGetter> timeGetter_;
-    std::string lastMessage_;
-    std::ostringstream streamer_;
-    Log streamerLogger_;
+    static void put_le_(std::string & out, std::uint64_t value, int bytes) {
+        for (auto i = 0; i < bytes; ++i) {
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
 
-    static MLogger& instance_() {
-        static MLogger instance;
-        return instance;
+    static std::uint64_t get_le_(char const * in, int bytes) {
+        std::uint64_t value = 0;
+        for (auto i = 0; i < bytes; ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        return value;
     }
 
-    static bool find_ostream_wrapper_(std::ostream const & stream) {
-        return std::any_of(instance_().ostreamWrappers_.begin(), instance_().ostreamWrappers_.end(),
-            [&](std::reference_wrapper<std::ostream> & wrapper) {
-                return wrapper.get() == stream;
-            });
+    static std::uint32_t fnv1a_(std::string const & data) {
+        std::uint32_t hash = 2166136261u;
+        for (auto c : data) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return hash;
     }
 
-    static bool find_ostream_ptr_(std::ostream const & stream) {
-        return std::any_of(instance_().ostreamPtrs_.begin(), instance_().ostreamPtrs_.end(),
-            [&](std::shared_ptr<std::ostream> & ptr) {
-                return *ptr == stream;
-            });
+    static void put_lz_length_(std::string & out, std::size_t length) {
+        while (length >= 255) {
+            out += static_cast<char>(255);
+            length -= 255;
+        }
+        out += static_cast<char>(length);
+    }
+
+    // LZ4 style compression: a sequence is a token (literal count << 4 | match length - 4,
+    // each saturating at 15 with the rest in extra length bytes), the literals, and a
+    // 16 bit offset back into the output followed by extra match length bytes.
+    // The last sequence has literals only.
+    static std::string lz_compress_(std::string const & in) {
+        static const std::size_t minMatch = 4;
+        std::string out;
+        out.reserve(in.size() / 2);
+        std::vector<std::size_t> table(1 << 13, std::string::npos);
+        std::size_t anchor = 0;
+        std::size_t pos = 0;
+        while (pos + minMatch <= in.size()) {
+            std::uint32_t bytes;
+            std::memcpy(&bytes, in.data() + pos, sizeof(bytes));
+            auto & slot = table[(bytes * 2654435761u) >> 19];
+            auto candidate = slot;
+            slot = pos;
+            if (candidate == std::string::npos || pos - candidate > 0xffff
+                || std::memcmp(in.data() + candidate, in.data() + pos, minMatch) != 0) {
+                ++pos;
+                continue;
+            }
+            auto length = minMatch;
+            while (pos + length < in.size() && in[candidate + length] == in[pos + length]) {
+                ++length;
+            }
+            auto literals = pos - anchor;
+            out += static_cast<char>((std::min<std::size_t>(literals, 15) << 4)
+                                     | std::min<std::size_t>(length - minMatch, 15));
+            if (literals >= 15) {
+                put_lz_length_(out, literals - 15);
+            }
+            out.append(in, anchor, literals);
+            put_le_(out, pos - candidate, 2);
+            if (length - minMatch >= 15) {
+                put_lz_length_(out, length - minMatch - 15);
+            }
+            pos += length;
+            anchor = pos;
+        }
+        auto literals = in.size() - anchor;
+        out += static_cast<char>(std::min<std::size_t>(literals, 15) << 4);
+        if (literals >= 15) {
+            put_lz_length_(out, literals - 15);
+        }
+        out.append(in, anchor, literals);
+        return out;
+    }
+
+    static bool lz_decompress_(std::string const & in, std::size_t rawSize, std::string & out) {
+        out.clear();
+        out.reserve(rawSize);
+        std::size_t pos = 0;
+        auto read_length = [&](std::size_t length) {
+            if (length == 15) {
+                unsigned char extra;
+                do {
+                    if (pos >= in.size()) {
+                        return std::string::npos;
+                    }
+                    extra = static_cast<unsigned char>(in[pos++]);
+                    length += extra;
+                } while (extra == 255);
+            }
+            return length;
+        };
+        while (pos < in.size()) {
+            auto token = static_cast<unsigned char>(in[pos++]);
+            auto literals = read_length(token >> 4);
+            if (literals == std::string::npos || literals > in.size() - pos || out.size() + literals > rawSize) {
+                return false;
+            }
+            out.append(in, pos, literals);
+            pos += literals;
+            if (pos == in.size()) {
+                break;
+            }
+            if (pos + 2 > in.size()) {
+                return false;
+            }
+            auto offset = static_cast<std::size_t>(get_le_(in.data() + pos, 2));
+            pos += 2;
+            auto length = read_length(token & 0x0f);
+            if (length == std::string::npos || offset == 0 || offset > out.size()
+                || out.size() + length + 4 > rawSize) {
+                return false;
+            }
+            length += 4;
+            auto from = out.size() - offset;
+            for (std::size_t i = 0; i < length; ++i) {
+                out += out[from + i];
+            }
+        }
+        return out.size() == rawSize;
     }
 
     static Colour get_colour_(std::string const & level) {
@@ -812,22 +3933,58 @@ private:
     }
 
     static std::string get_time_() {
-        return (*(instance_().timeGetter_))();
+        ConfigReader config;
+        return (*config->timeGetter)();
+    }
+
+    // Bit for the level in Config::levelMask, 0 for an invalid level.
+    // Levels are ordered from trace (lowest bit) to fatal.
+    static unsigned level_bit_(std::string const & level) {
+        if (level == "trace") {
+            return 1u << 0;
+        } else if (level == "debug") {
+            return 1u << 1;
+        } else if (level == "info") {
+            return 1u << 2;
+        } else if (level == "warn") {
+            return 1u << 3;
+        } else if (level == "error") {
+            return 1u << 4;
+        } else if (level == "fatal") {
+            return 1u << 5;
+        }
+        return 0;
+    }
+
+    // Position of the level from trace (0) to fatal (5), 0 for an invalid level
+    static int level_index_(std::string const & level) {
+        auto bit = level_bit_(level);
+        auto index = 0;
+        while (bit > 1) {
+            bit >>= 1;
+            ++index;
+        }
+        return index;
+    }
+
+    static std::string level_name_(int index) {
+        static char const * const names[] = {"trace", "debug", "info", "warn", "error", "fatal"};
+        return index >= 0 && index < 6 ? names[index] : "";
     }
 
-    static bool is_valid_level_(std::string const & level) {
-        return level == "trace"
-            || level == "debug"
-            || level == "info"
-            || level == "warn"
-            || level == "error"
-            || level == "fatal";
+    // The level and every level below it, 0 for an invalid level
+    static unsigned max_level_mask_(std::string const & level) {
+        auto bit = level_bit_(level);
+        return bit == 0 ? 0 : (bit << 1) - 1;
     }
 
     static bool is_added_level_(std::string const & level) {
-        return instance_().levels_.find(level) != instance_().levels_.end();
+        ConfigReader config;
+        return (config->levelMask & level_bit_(level)) != 0;
     }
 
 };
 
+#undef MLOGGER_POSIX
+
 #endif // MLOGGER_HPP_
@@ -0,0 +1,53 @@
+#include "MLogger.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// Collects the records a process writes with MLogger::add_shm_ring and appends them,
+// rendered as text, to a file. Runs until interrupted; can be restarted at any time.
+// Usage: collector <ring name> <output file>
+
+namespace {
+    volatile std::sig_atomic_t running = 1;
+
+    void stop(int) {
+        running = 0;
+    }
+}
+
+int main(int argc, char * argv[]) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <ring name> <output file>" << std::endl;
+        return 1;
+    }
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::ofstream output(argv[2], std::ios::app);
+    if (!output.is_open()) {
+        std::cerr << "cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+    // The ring may not exist until the producer starts
+    std::unique_ptr<MLogger::ShmCollector> collector(new MLogger::ShmCollector(argv[1]));
+    while (running && !collector->is_open()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        collector.reset(new MLogger::ShmCollector(argv[1]));
+    }
+    auto lastOverwritten = collector->overwritten();
+    while (running) {
+        if (collector->poll(output) == 0) {
+            output.flush();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (collector->overwritten() != lastOverwritten) {
+            lastOverwritten = collector->overwritten();
+            std::cerr << lastOverwritten << " records overwritten before they were collected" << std::endl;
+        }
+    }
+    collector->poll(output);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include "MLogger.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+// Prints the records of a file written by MLogger::add_compressed_file, optionally
+// starting from the block covering a time given in seconds since the epoch.
+// Usage: decompress <file> [from]
+int main(int argc, char * argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <file> [from]" << std::endl;
+        return 1;
+    }
+    auto from = std::chrono::system_clock::time_point();
+    if (argc == 3) {
+        from += std::chrono::seconds(std::strtoll(argv[2], nullptr, 10));
+    }
+    return MLogger::decompress_file(argv[1], std::cout, from) ? 0 : 1;
+}
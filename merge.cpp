@@ -0,0 +1,19 @@
+#include "MLogger.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Merges the per thread shards written by MLogger::add_sharded_file back into one log.
+// Usage: merge <prefix> [output file]
+int main(int argc, char * argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <prefix> [output file]" << std::endl;
+        return 1;
+    }
+    if (argc == 3) {
+        std::ofstream output(argv[2]);
+        return output.is_open() && MLogger::merge_shards(argv[1], output) ? 0 : 1;
+    }
+    return MLogger::merge_shards(argv[1], std::cout) ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+#include "MLogger.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Prints the records of a file written with MLogger::add_file(fileName, true) that were
+// logged between two times, given in seconds since the epoch ("-" for no bound), at any
+// of the given levels (all levels if none are given).
+// Usage: query <file> <from> <to> [level...]
+int main(int argc, char * argv[]) {
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0] << " <file> <from> <to> [level...]" << std::endl;
+        return 1;
+    }
+    auto from = std::chrono::system_clock::time_point::min();
+    auto to = std::chrono::system_clock::time_point::max();
+    if (std::string(argv[2]) != "-") {
+        from = std::chrono::system_clock::time_point() + std::chrono::seconds(std::strtoll(argv[2], nullptr, 10));
+    }
+    if (std::string(argv[3]) != "-") {
+        to = std::chrono::system_clock::time_point() + std::chrono::seconds(std::strtoll(argv[3], nullptr, 10) + 1)
+           - std::chrono::nanoseconds(1);
+    }
+    std::vector<std::string> levels(argv + 4, argv + argc);
+    return MLogger::query_file(argv[1], std::cout, from, to, levels) ? 0 : 1;
+}
@@ -1,8 +1,28 @@
 #include "MLogger.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static volatile std::sig_atomic_t previousUsr1Calls = 0;
+
+static void count_usr1(int) {
+    ++previousUsr1Calls;
+}
 
 int main(void) {
     using namespace std;
@@ -87,8 +107,359 @@ int main(void) {
     MLogger::reset_time_getter();
     MLogger::info("info with default date formatter");
 
-    // Get last logged message (useful for tests)
+    // Get last logged message (useful for tests), kept per thread
     assert(MLogger::last_message() == "info with default date formatter");
+    std::thread([] { MLogger::info("info from another thread"); }).join();
+    assert(MLogger::last_message() == "info with default date formatter");
+
+    // Socket sink, with a local datagram socket standing in for the collector
+    auto collector = socket(AF_UNIX, SOCK_DGRAM, 0);
+    sockaddr_un collectorAddr = {};
+    collectorAddr.sun_family = AF_UNIX;
+    std::strcpy(collectorAddr.sun_path, "test.sock");
+    unlink("test.sock");
+    assert(bind(collector, reinterpret_cast<sockaddr *>(&collectorAddr), sizeof(collectorAddr)) == 0);
+    assert(MLogger::add_socket(MLogger::SocketType::unix_dgram, "test.sock"));
+    MLogger::info("info sent to the collector");
+    MLogger::info("info packed into the same datagram");
+    MLogger::flush();
+    char datagram[8192];
+    auto received = recv(collector, datagram, sizeof(datagram), 0);
+    assert(received > 0);
+    auto packed = std::string(datagram, received);
+    assert(packed.find("[info] : info sent to the collector\n") != std::string::npos);
+    assert(packed.find("[info] : info packed into the same datagram\n") != std::string::npos);
+    assert(MLogger::dropped_socket_records() == 0);
+    close(collector);
+    unlink("test.sock");
+
+    // Syslog framing turns context keys into valid SD-PARAM names
+    auto syslogCollector = socket(AF_UNIX, SOCK_DGRAM, 0);
+    std::strcpy(collectorAddr.sun_path, "test.syslog.sock");
+    unlink("test.syslog.sock");
+    assert(bind(syslogCollector, reinterpret_cast<sockaddr *>(&collectorAddr), sizeof(collectorAddr)) == 0);
+    assert(MLogger::add_socket(MLogger::SocketType::unix_dgram, "test.syslog.sock", true));
+    {
+        auto odd = MLogger::context::push("user id=\"x]", "7");
+        MLogger::info("info with an odd context key");
+    }
+    MLogger::flush();
+    received = recv(syslogCollector, datagram, sizeof(datagram), 0);
+    assert(received > 0);
+    assert(std::string(datagram, received).find("[context@32473 user_id__x_=\"7\"]") != std::string::npos);
+    close(syslogCollector);
+    unlink("test.syslog.sock");
+
+    // Scoped spans indent everything logged inside them and report their duration
+    assert(MLogger::add_trace_file("test.trace.json"));
+    {
+        MLogger::scope request("request", "info");
+        MLogger::info("inside request, sublevel 1");
+        {
+            MLogger::scope parse("parse", "info");
+            MLogger::info("inside parse, sublevel 2");
+        }
+        assert(MLogger::remove_level("debug"));
+        MLogger::scope ignored("not logged, debug is not enabled", "debug");
+    }
+    assert(MLogger::add_level("debug"));
+    assert(MLogger::last_message().find("<- request (") == 0);
+    MLogger::flush();
+    std::ifstream traceFile("test.trace.json");
+    std::stringstream trace;
+    trace << traceFile.rdbuf();
+    assert(trace.str().find("{\"name\":\"parse\",\"cat\":\"info\",\"ph\":\"X\"") != std::string::npos);
+    assert(trace.str().find("\"name\":\"request\"") != std::string::npos);
+    assert(trace.str().find("not logged") == std::string::npos);
+
+    // Levels and outputs can be replaced from a config file while running
+    std::ofstream("test.conf") << "# reloaded by the test\nlevels = warn, error, fatal\nostream = stdout\nfile = test.log\n";
+    assert(MLogger::load_config("test.conf"));
+    MLogger::info("info filtered out by the config file");
+    assert(MLogger::last_message().find("<- request (") == 0);
+    MLogger::warn("warn allowed by the config file");
+    assert(MLogger::last_message() == "warn allowed by the config file");
+
+    // ... and reloaded when the file is rewritten or on a signal
+    std::signal(SIGUSR1, &count_usr1); // Put back when watching stops
+    assert(MLogger::watch_config("test.conf", SIGUSR1));
+    std::ofstream("test.conf") << "max_level = fatal\n";
+    for (auto i = 0; i < 200 && MLogger::last_message() != "info after the config file changed"; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        MLogger::info("info after the config file changed");
+    }
+    assert(MLogger::last_message() == "info after the config file changed");
+    {
+        // Kept open, so only the signal tells the watcher the file changed
+        std::ofstream pending("test.conf");
+        pending << "levels = warn, error, fatal\n" << std::flush;
+        std::raise(SIGUSR1);
+        for (auto i = 0; i < 200 && MLogger::last_message() != "warn after the signal"; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            MLogger::warn("warn after the signal");
+            MLogger::info("info filtered out after the signal");
+        }
+        assert(MLogger::last_message() == "warn after the signal");
+    }
+    MLogger::stop_watching_config();
+    assert(previousUsr1Calls == 0);
+    std::raise(SIGUSR1);
+    assert(previousUsr1Calls == 1);
+    MLogger::set_max_level("fatal");
+
+    // Per thread sharded files, merged back together in logging order
+    std::ofstream("test.shard.99.log") << "0 0 left over from an earlier run\n";
+    assert(MLogger::add_sharded_file("test.shard"));
+    MLogger::info("sharded 0");
+    std::thread([] { MLogger::info("sharded 1"); }).join();
+    std::thread([] { MLogger::info("sharded 2"); }).join();
+    assert(!std::ifstream("test.shard.2.log").is_open()); // The second thread got the first one's shard back
+    MLogger::info("sharded 3");
+    assert(MLogger::add_sharded_file("test.shard") == false); // And leaves the live shards alone
+    MLogger::flush();
+    std::ostringstream merged;
+    assert(MLogger::merge_shards("test.shard", merged));
+    auto mergedLog = merged.str();
+    assert(mergedLog.find("sharded 0") < mergedLog.find("sharded 1"));
+    assert(mergedLog.find("sharded 1") < mergedLog.find("sharded 2"));
+    assert(mergedLog.find("sharded 2") < mergedLog.find("sharded 3"));
+    assert(mergedLog.find("] : sharded 3\n") != std::string::npos);
+    assert(mergedLog.find("earlier run") == std::string::npos);
+
+    // Compressed files, made of independently decodable blocks
+    assert(MLogger::add_compressed_file("test.log.mlz"));
+    for (auto i = 0; i < 100; ++i) {
+        MLogger::stream().debug() << "compressed record " << i;
+    }
+    MLogger::flush();
+    std::ostringstream decompressed;
+    assert(MLogger::decompress_file("test.log.mlz", decompressed));
+    assert(decompressed.str().find("] : compressed record 0\n") != std::string::npos);
+    assert(decompressed.str().find("] : compressed record 99\n") != std::string::npos);
+    std::ifstream compressedFile("test.log.mlz", std::ios::binary | std::ios::ate);
+    assert(static_cast<std::size_t>(compressedFile.tellg()) < decompressed.str().size() / 2);
+
+    // Files with a sidecar index, queried by time range and level
+    assert(MLogger::add_file("test.indexed.log", true));
+    MLogger::debug("indexed debug");
+    MLogger::error("indexed error");
+    assert(MLogger::add_file("test.indexed.log", true) == false); // Leaves the live file and index alone
+    MLogger::flush();
+    std::ostringstream errors;
+    assert(MLogger::query_file("test.indexed.log", errors, std::chrono::system_clock::now() - std::chrono::hours(1),
+                               std::chrono::system_clock::now(), std::vector<std::string>{"error"}));
+    assert(errors.str().find("] : indexed error\n") != std::string::npos);
+    assert(errors.str().find("indexed debug") == std::string::npos);
+    std::ostringstream future;
+    assert(MLogger::query_file("test.indexed.log", future, std::chrono::system_clock::now() + std::chrono::hours(1)));
+    assert(future.str().empty());
+
+    // Async mode: severe records jump the queue, but each thread's records stay in order
+    std::ostringstream asyncOutput;
+    assert(MLogger::add_ostream(asyncOutput));
+    MLogger::set_async(true, 0); // No room below error, so those records are dropped
+    MLogger::debug("async debug, dropped");
+    MLogger::error("async error, kept");
+    MLogger::flush();
+    assert(MLogger::dropped_async_records() == 1);
+    assert(asyncOutput.str().find("async debug") == std::string::npos);
+    assert(asyncOutput.str().find("] : async error, kept\n") != std::string::npos);
+    MLogger::set_async(true);
+    MLogger::info("async info before fatal");
+    MLogger::fatal("async fatal, written before returning");
+    assert(asyncOutput.str().find("async info before fatal") < asyncOutput.str().find("async fatal"));
+    {
+        // fatal only waits for what was queued before it, so busy threads cannot hold it up
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        std::atomic<bool> fatalReturned(false);
+        std::vector<std::thread> busyThreads;
+        for (auto i = 0; i < 4; ++i) {
+            busyThreads.emplace_back([&] {
+                while (!fatalReturned && std::chrono::steady_clock::now() < deadline) {
+                    MLogger::info("async info from a busy thread");
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        MLogger::fatal("async fatal while other threads log");
+        fatalReturned = true;
+        assert(std::chrono::steady_clock::now() < deadline);
+        for (auto & thread : busyThreads) {
+            thread.join();
+        }
+        MLogger::flush(); // The writer is still busy with their records
+    }
+    assert(asyncOutput.str().find("] : async fatal while other threads log\n") != std::string::npos);
+    MLogger::set_async(false);
+
+    // Shared memory ring, rendered by a collector (normally in another process)
+    shm_unlink("/mlogger_test");
+    assert(MLogger::add_shm_ring("/mlogger_test"));
+    MLogger::info("info through shared memory", 1);
+    MLogger::ShmCollector ringCollector("/mlogger_test");
+    assert(ringCollector.is_open());
+    std::ostringstream collected;
+    assert(ringCollector.poll(collected) == 1);
+    assert(collected.str().find("    ") == 0);
+    assert(collected.str().find(" [info] : info through shared memory\n") != std::string::npos);
+    {
+        // A full ring overwrites the oldest records and counts them
+        shm_unlink("/mlogger_test_small");
+        MLogger::ShmRingSink smallRing("/mlogger_test_small", 4, 64);
+        for (auto i = 0; i < 10; ++i) {
+            smallRing.write(MLogger::Record{"debug", "ring record " + std::to_string(i), 0,
+                                            std::chrono::system_clock::now(), "", nullptr});
+        }
+        assert(smallRing.overwritten() == 6);
+        MLogger::ShmCollector smallCollector("/mlogger_test_small");
+        std::ostringstream newest;
+        assert(smallCollector.poll(newest) == 4);
+        assert(smallCollector.lost() == 6);
+        assert(newest.str().find("ring record 6") != std::string::npos);
+        // A batch takes consecutive slots
+        MLogger::Batch pair;
+        for (auto name : {"ring batch a", "ring batch b"}) {
+            pair.records.push_back(MLogger::Record{"info", name, 0, std::chrono::system_clock::now(), "", nullptr});
+        }
+        smallRing.write_batch(pair);
+        std::ostringstream batched;
+        assert(smallCollector.poll(batched) == 2);
+        assert(batched.str().find("ring batch a") < batched.str().find("ring batch b"));
+        shm_unlink("/mlogger_test_small");
+    }
+    shm_unlink("/mlogger_test");
+
+    // Diagnostic context, prefixed to everything the thread logs while it is pushed
+    std::ostringstream contextOutput;
+    assert(MLogger::add_ostream(contextOutput));
+    {
+        auto request = MLogger::context::push("req", "42");
+        auto tenant = MLogger::context::push("tenant", "acme");
+        MLogger::info("info with a context");
+        std::thread([] { MLogger::info("info from another thread"); }).join();
+        assert(MLogger::context::fields().size() == 2);
+    }
+    MLogger::info("info after the context is popped");
+    assert(contextOutput.str().find("] : [req=42 tenant=acme] info with a context\n") != std::string::npos);
+    assert(contextOutput.str().find("] : info from another thread\n") != std::string::npos);
+    assert(contextOutput.str().find("] : info after the context is popped\n") != std::string::npos);
+    assert(MLogger::context::fields().empty());
+
+    // Backpressure sheds trace and debug while an output is slow, and restores them after
+    struct SlowSink : public MLogger::Sink {
+        bool slow = true;
+        void write(MLogger::Record const &) {
+            if (slow) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        }
+    };
+    auto slowSink = std::make_shared<SlowSink>();
+    assert(MLogger::add_sink(slowSink));
+    MLogger::set_backpressure({std::chrono::microseconds(1000), std::chrono::microseconds(500), 0, 0,
+                               std::chrono::milliseconds(20)});
+    MLogger::debug("debug written while the output is slow");
+    assert(MLogger::backpressure_degradations() == 1);
+    assert(contextOutput.str().find("[warn] : backpressure: now shedding trace and debug (") != std::string::npos);
+    MLogger::debug("debug shed");
+    assert(MLogger::shed_records() == 1);
+    slowSink->slow = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    MLogger::debug("debug shed, but checks the output again");
+    // Nothing was written, so the step holds until a probe shows the output recovered
+    assert(contextOutput.str().find("[warn] : backpressure: now shedding nothing (") == std::string::npos);
+    MLogger::debug("debug written to probe the output");
+    assert(MLogger::last_message() == "debug written to probe the output");
+    std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    MLogger::debug("debug shed, but checks the probe");
+    assert(contextOutput.str().find("[warn] : backpressure: now shedding nothing (") != std::string::npos);
+    assert(MLogger::backpressure_degradations() == 1);
+    MLogger::debug("debug written after the output recovered");
+    assert(MLogger::last_message() == "debug written after the output recovered");
+    MLogger::clear_backpressure();
+
+    // Durable file: error and fatal wait for a sync shared with every other thread
+    auto durable = std::make_shared<MLogger::DurableFileSink>("test.durable.log");
+    assert(durable->is_open());
+    assert(MLogger::add_sink(durable));
+    MLogger::info("info, not waited for");
+    MLogger::error("error, on disk before returning");
+    assert(durable->commits() == 1);
+    assert(!MLogger::DurableFileSink::last_write_failed());
+    MLogger::set_async(true); // error skips the queue, so it still waits
+    MLogger::error("async error, on disk before returning");
+    assert(durable->commits() == 2);
+    MLogger::set_async(false);
+    std::vector<std::thread> durableThreads;
+    for (auto i = 0; i < 4; ++i) {
+        durableThreads.emplace_back([] {
+            for (auto j = 0; j < 25; ++j) {
+                MLogger::error("durable error from many threads");
+            }
+        });
+    }
+    for (auto & thread : durableThreads) {
+        thread.join();
+    }
+    assert(durable->commits() < 100); // Records share commits
+    assert(durable->failed_commits() == 0);
+    assert(durable->failed_writes() == 0);
+    MLogger::DurableFileSink full("/dev/full"); // Every write fails with ENOSPC
+    if (full.is_open()) {
+        full.write(MLogger::Record{"error", "not durable", 0, std::chrono::system_clock::now(), "not durable", nullptr});
+        assert(full.failed_writes() == 1);
+        assert(MLogger::DurableFileSink::last_write_failed());
+    }
+    MLogger::DurableFileSink unsyncable("/dev/null"); // Writes succeed, fdatasync fails with EINVAL
+    if (unsyncable.is_open()) {
+        unsyncable.write(MLogger::Record{"error", "not synced", 0, std::chrono::system_clock::now(), "not synced", nullptr});
+        assert(unsyncable.failed_commits() == 1);
+        assert(MLogger::DurableFileSink::last_write_failed());
+    }
+    std::ifstream durableFile("test.durable.log");
+    std::stringstream durableLog;
+    durableLog << durableFile.rdbuf();
+    assert(durableLog.str().find("] : info, not waited for\n") < durableLog.str().find("] : error, on disk"));
+
+    // Batches are rendered into one buffer and written to each output at once
+    {
+        MLogger::batch summaries;
+        for (auto i = 0; i < 3; ++i) {
+            summaries.info("batch item " + std::to_string(i));
+        }
+        assert(summaries.size() == 3);
+        summaries.commit();
+        assert(summaries.size() == 0);
+        assert(MLogger::last_message() == "batch item 2");
+        assert(contextOutput.str().find("] : batch item 0\n") != std::string::npos);
+        assert(contextOutput.str().find("] : batch item 0\n") < contextOutput.str().find("] : batch item 2\n"));
+
+        MLogger::batch timed(true); // One clock read per record, committed when destroyed
+        timed.warn("timed batch item", 1);
+    }
+    auto timedLine = contextOutput.str().find("] : timed batch item\n");
+    assert(timedLine != std::string::npos);
+    assert(contextOutput.str().compare(contextOutput.str().rfind('\n', timedLine) + 1, 4, "    ") == 0);
+
+    // Removed outputs are released right away, even while a thread that logged is idle
+    std::weak_ptr<MLogger::Sink> removedSink = durable;
+    slowSink.reset();
+    durable.reset();
+    std::atomic<bool> quietLogged(false), quietDone(false);
+    std::thread quiet([&] {
+        MLogger::info("info before going quiet");
+        quietLogged = true;
+        while (!quietDone) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    while (!quietLogged) {
+        std::this_thread::yield();
+    }
+    MLogger::clear_ostreams();
+    assert(removedSink.expired());
+    quietDone = true;
+    quiet.join();
 
     // Non-added logging levels do not show up
     assert(MLogger::remove_level("info"));